@@ -0,0 +1,117 @@
+/**************************************************************************************
+   LED effects and their compile-time registry
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Each effect is a type with two static hooks:
+
+     changed(ctx)  returns true if the effect would draw something different
+                   from what it drew last, called every frame
+     render(ctx)   draws into ctx.leds, called only when changed() said so
+
+   EffectRegistry<...> turns a list of effect types into a dispatch table in
+   flash, indexed by the number sent in the 'e' MQTT command. Effects that are
+   not in the list are never instantiated, so they cost no flash or IRAM.
+
+ **************************************************************************************/
+
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <FastLED.h>
+#include "PaletteLut.h"
+
+// What effects may read and draw into, rebuilt by runLedEffect() every frame
+struct EffectContext
+{
+  CRGB *leds;
+  PaletteLut &lut;
+  const CRGBPalette16 &palette;
+  uint8_t brightness;
+  TBlendType blending;
+  bool havePalette; // False while the default rainbow is shown before the first forecast
+  CRGB solidColor;
+  bool dirty; // Something the effect doesn't track itself changed, draw again
+};
+
+/**
+   Forecast palette stretched over the whole strip. Scrolls while there is no
+   forecast yet, so a connecting lamp is easy to tell apart from a stuck one.
+*/
+template <uint16_t N>
+struct PaletteEffect
+{
+  static bool changed(EffectContext &ctx)
+  {
+    if (!ctx.havePalette)
+    {
+      _scrollIndex++;
+    }
+    bool lutChanged = ctx.lut.update(ctx.palette, ctx.brightness, ctx.blending);
+    return ctx.dirty || lutChanged || startIndex(ctx) != _renderedIndex;
+  }
+
+  static void render(EffectContext &ctx)
+  {
+    _renderedIndex = startIndex(ctx);
+    fillFromPaletteLut<N>(ctx.leds, ctx.lut, _renderedIndex);
+  }
+
+  // A forecast always starts from LED 0, the current slot
+  static uint8_t startIndex(const EffectContext &ctx) { return ctx.havePalette ? 0 : _scrollIndex; }
+
+  static uint8_t _scrollIndex; // Offset of the connecting scroll
+  static uint8_t _renderedIndex;
+};
+
+template <uint16_t N>
+uint8_t PaletteEffect<N>::_scrollIndex = 0;
+template <uint16_t N>
+uint8_t PaletteEffect<N>::_renderedIndex = 0;
+
+// Every LED in the colour set with the 'c' MQTT command
+template <uint16_t N>
+struct SolidEffect
+{
+  static bool changed(EffectContext &ctx) { return ctx.dirty; }
+
+  static void render(EffectContext &ctx)
+  {
+    for (uint16_t i = 0; i < N; i++)
+    {
+      ctx.leds[i] = ctx.solidColor;
+    }
+  }
+};
+
+struct EffectEntry
+{
+  bool (*changed)(EffectContext &ctx);
+  void (*render)(EffectContext &ctx);
+};
+
+template <class... Effects>
+struct EffectRegistry
+{
+  static const uint8_t count = sizeof...(Effects);
+
+  static bool changed(uint8_t effect, EffectContext &ctx)
+  {
+    typedef bool (*Changed)(EffectContext &);
+    return ((Changed)pgm_read_ptr(&_table[effect].changed))(ctx);
+  }
+
+  static void render(uint8_t effect, EffectContext &ctx)
+  {
+    typedef void (*Render)(EffectContext &);
+    ((Render)pgm_read_ptr(&_table[effect].render))(ctx);
+  }
+
+  static const EffectEntry _table[sizeof...(Effects)];
+};
+
+template <class... Effects>
+const EffectEntry EffectRegistry<Effects...>::_table[sizeof...(Effects)] PROGMEM = {
+    {&Effects::changed, &Effects::render}...};
+
+#endif
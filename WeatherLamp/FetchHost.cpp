@@ -0,0 +1,76 @@
+#include "FetchHost.h"
+
+FetchHost::FetchHost(uint16_t defaultPort)
+    : _defaultPort(defaultPort), _port(defaultPort), _addrCached(false), _addrResolvedAt(0), _resolved(false)
+{
+  _host[0] = '\0';
+  _path[0] = '\0';
+}
+
+bool FetchHost::setUrl(const char *url, const char *scheme)
+{
+  size_t schemeLen = strlen(scheme);
+  if (strncmp(url, scheme, schemeLen) != 0)
+  {
+    return false;
+  }
+  const char *host = url + schemeLen;
+  const char *path = strchr(host, '/');
+  if (path == NULL)
+  {
+    path = host + strlen(host);
+  }
+  const char *colon = (const char *)memchr(host, ':', path - host);
+  const char *hostEnd = colon ? colon : path;
+  size_t hostLen = hostEnd - host;
+  if (hostLen == 0 || hostLen >= sizeof(_host) || strlen(path) >= sizeof(_path))
+  {
+    return false;
+  }
+  if (hostLen != strlen(_host) || memcmp(_host, host, hostLen) != 0)
+  {
+    _addrCached = false; // Cached address belongs to the old host
+  }
+  memcpy(_host, host, hostLen);
+  _host[hostLen] = '\0';
+  _port = colon ? atoi(colon + 1) : _defaultPort;
+  strcpy(_path, *path ? path : "/");
+  return true;
+}
+
+bool FetchHost::resolve()
+{
+  if (_addrCached && millis() - _addrResolvedAt < FETCH_DNS_TTL_MS)
+  {
+    _resolved = true;
+    return true;
+  }
+  _resolved = false;
+  _addrCached = false;
+  ip_addr_t addr;
+  err_t err = dns_gethostbyname(_host, &addr, &FetchHost::onDnsFound, this);
+  if (err == ERR_OK)
+  {
+    _addr = IPAddress(&addr);
+    _addrCached = true;
+    _addrResolvedAt = millis();
+    _resolved = true;
+  }
+  return err == ERR_OK || err == ERR_INPROGRESS;
+}
+
+/**
+   An answer that comes after its fetch has timed out still fills the cache,
+   the next fetch can use it
+*/
+void FetchHost::onDnsFound(const char *name, FETCH_DNS_CONST ip_addr_t *ipaddr, void *arg)
+{
+  FetchHost *self = (FetchHost *)arg;
+  if (ipaddr)
+  {
+    self->_addr = IPAddress(ipaddr);
+    self->_addrCached = true;
+    self->_addrResolvedAt = millis();
+  }
+  self->_resolved = true;
+}
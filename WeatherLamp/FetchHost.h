@@ -0,0 +1,63 @@
+/**************************************************************************************
+   Server address of a palette fetch: URL parsing and cached DNS resolution
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Shared by the HTTP and UDP transports. The host is resolved asynchronously
+   with lwIP DNS and the address is kept for FETCH_DNS_TTL_MS, so most fetches
+   don't resolve at all.
+
+ **************************************************************************************/
+
+#ifndef FETCH_HOST_H
+#define FETCH_HOST_H
+
+#include <Arduino.h>
+#include <lwip/init.h>
+#include <lwip/dns.h>
+
+#if LWIP_VERSION_MAJOR == 1
+#define FETCH_DNS_CONST
+#else
+#define FETCH_DNS_CONST const
+#endif
+
+#define FETCH_HOST_MAX 64
+#define FETCH_PATH_MAX 128
+#define FETCH_DNS_TTL_MS (10 * 60 * 1000UL)
+
+class FetchHost
+{
+public:
+  explicit FetchHost(uint16_t defaultPort);
+  // Parse a <scheme>host[:port]/path URL, e.g. scheme "http://". Returns false
+  // and keeps the current URL if url isn't one or doesn't fit.
+  bool setUrl(const char *url, const char *scheme);
+  bool isSet() const { return _host[0] != '\0'; }
+  // Start resolving, or take the cached address if it hasn't expired. Returns
+  // false if the lookup failed right away.
+  bool resolve();
+  // resolve() has finished, found() tells whether it got an address
+  bool resolved() const { return _resolved; }
+  bool found() const { return _addrCached; }
+  // Drop the cached address, the server may have moved
+  void forget() { _addrCached = false; }
+  const char *host() const { return _host; }
+  const char *path() const { return _path; }
+  uint16_t port() const { return _port; }
+  const IPAddress &addr() const { return _addr; }
+
+private:
+  static void onDnsFound(const char *name, FETCH_DNS_CONST ip_addr_t *ipaddr, void *arg);
+
+  char _host[FETCH_HOST_MAX];
+  char _path[FETCH_PATH_MAX];
+  uint16_t _defaultPort;
+  uint16_t _port;
+  IPAddress _addr;
+  bool _addrCached;
+  unsigned long _addrResolvedAt;
+  bool _resolved;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "FrameTimer.h"
+
+// Frame periods are 10-40 ms, LED data for a short strip takes well under 1 ms
+static const unsigned long FRAME_BOUNDS_US[] = {1000, 2000, 5000, 10000, 20000, 40000, 100000};
+static const unsigned long SHOW_BOUNDS_US[] = {100, 250, 500, 1000, 2000, 5000, 10000};
+
+void DurationStats::reset()
+{
+  min = (unsigned long)-1;
+  max = 0;
+  sum = 0;
+  count = 0;
+}
+
+void DurationStats::add(unsigned long us)
+{
+  if (us < min)
+  {
+    min = us;
+  }
+  if (us > max)
+  {
+    max = us;
+  }
+  sum += us;
+  count++;
+}
+
+DurationHistogram::DurationHistogram(const unsigned long *upperBounds, uint8_t boundCount)
+    : bounds(upperBounds), size(boundCount), sum(0), count(0)
+{
+  memset(counts, 0, sizeof(counts));
+}
+
+void DurationHistogram::add(unsigned long us)
+{
+  uint8_t i = 0;
+  while (i < size && us > bounds[i])
+  {
+    i++;
+  }
+  counts[i]++;
+  sum += us;
+  count++;
+}
+
+FrameTimer::FrameTimer(unsigned long periodUs)
+    : _period(periodUs), _started(false), _next(0), _frameStart(0), _showStart(0), _missed(0), _missedTotal(0),
+      _frameHist(FRAME_BOUNDS_US, sizeof(FRAME_BOUNDS_US) / sizeof(FRAME_BOUNDS_US[0])),
+      _showHist(SHOW_BOUNDS_US, sizeof(SHOW_BOUNDS_US) / sizeof(SHOW_BOUNDS_US[0]))
+{
+  reset();
+}
+
+bool FrameTimer::due()
+{
+  unsigned long now = micros();
+  if (!_started)
+  {
+    // Schedule starts with the first frame, boot and setup() aren't missed frames
+    _started = true;
+    _next = now;
+  }
+  if ((long)(now - _next) < 0)
+  {
+    return false;
+  }
+  _frameStart = now;
+  unsigned long late = now - _next;
+  if (late >= _period)
+  {
+    // Dropped one or more frames, start a new schedule from now
+    _missed += late / _period;
+    _missedTotal += late / _period;
+    _next = now + _period;
+  }
+  else
+  {
+    _next += _period;
+  }
+  return true;
+}
+
+void FrameTimer::endShow()
+{
+  unsigned long us = micros() - _showStart;
+  _show.add(us);
+  _showHist.add(us);
+}
+
+void FrameTimer::endFrame()
+{
+  unsigned long us = micros() - _frameStart;
+  _frame.add(us);
+  _frameHist.add(us);
+}
+
+void FrameTimer::report(Print &out) const
+{
+  out.printf_P(PSTR("frames: %lu missed: %lu period_us: %lu\n"), _frame.count, _missed, _period);
+  out.printf_P(PSTR("frame_us min/mean/max: %lu/%lu/%lu\n"),
+               _frame.count ? _frame.min : 0, _frame.mean(), _frame.max);
+  out.printf_P(PSTR("shows: %lu show_us min/mean/max: %lu/%lu/%lu\n"),
+               _show.count, _show.count ? _show.min : 0, _show.mean(), _show.max);
+}
+
+void FrameTimer::reset()
+{
+  _missed = 0;
+  _frame.reset();
+  _show.reset();
+}
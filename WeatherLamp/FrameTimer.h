@@ -0,0 +1,85 @@
+/**************************************************************************************
+   Fixed-timestep frame scheduler with frame time statistics
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Frames are started on absolute micros() deadlines, so render and show() time
+   don't add up to the frame period. A frame that starts more than one period
+   late counts as missed, and the schedule is re-anchored instead of bursting
+   to catch up.
+
+   Frame and show() times are also kept in histograms that reset() doesn't
+   clear, for the /metrics endpoint.
+
+ **************************************************************************************/
+
+#ifndef FRAME_TIMER_H
+#define FRAME_TIMER_H
+
+#include <Arduino.h>
+
+struct DurationStats
+{
+  unsigned long min;
+  unsigned long max;
+  unsigned long long sum;
+  unsigned long count;
+
+  void reset();
+  void add(unsigned long us);
+  unsigned long mean() const { return count ? sum / count : 0; }
+};
+
+#define HISTOGRAM_MAX_BUCKETS 8
+
+// Histogram with fixed upper bounds and a last +Inf bucket. counts are per
+// bucket, Metrics adds them up into Prometheus' cumulative buckets.
+struct DurationHistogram
+{
+  const unsigned long *bounds; // Upper bounds in microseconds, ascending
+  uint8_t size;                // Number of bounds
+  unsigned long counts[HISTOGRAM_MAX_BUCKETS + 1];
+  unsigned long long sum;
+  unsigned long count;
+
+  DurationHistogram(const unsigned long *upperBounds, uint8_t boundCount);
+  void add(unsigned long us);
+};
+
+class FrameTimer
+{
+public:
+  explicit FrameTimer(unsigned long periodUs);
+  // Returns true (and starts the frame) when the next frame deadline has been reached
+  bool due();
+  void beginShow() { _showStart = micros(); }
+  void endShow();
+  void endFrame();
+  // Print statistics collected since the last reset
+  void report(Print &out) const;
+  void reset();
+
+  unsigned long frames() const { return _frame.count; }
+  unsigned long missed() const { return _missed; }
+  const DurationStats &frameStats() const { return _frame; }
+  const DurationStats &showStats() const { return _show; }
+  // Since boot, not cleared by reset()
+  unsigned long missedTotal() const { return _missedTotal; }
+  const DurationHistogram &frameHistogram() const { return _frameHist; }
+  const DurationHistogram &showHistogram() const { return _showHist; }
+
+private:
+  unsigned long _period;
+  bool _started;
+  unsigned long _next;
+  unsigned long _frameStart;
+  unsigned long _showStart;
+  unsigned long _missed;
+  unsigned long _missedTotal;
+  DurationStats _frame;
+  DurationStats _show;
+  DurationHistogram _frameHist;
+  DurationHistogram _showHist;
+};
+
+#endif
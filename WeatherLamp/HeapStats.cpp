@@ -0,0 +1,94 @@
+#include "HeapStats.h"
+
+// Section boundaries from the ESP8266 linker script
+extern "C" char _data_start, _data_end, _rodata_start, _rodata_end, _bss_start, _bss_end, _heap_start;
+
+#ifdef HEAP_COUNTERS
+// Plain increments, an allocation from an interrupt could in theory lose a count
+static HeapCounters counters = {0, 0, 0};
+
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+  void __real_free(void *ptr);
+
+  void *__wrap_malloc(size_t size)
+  {
+    counters.allocs++;
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    counters.allocs++;
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    if (ptr == NULL)
+    {
+      counters.allocs++;
+    }
+    else if (size == 0)
+    {
+      counters.frees++;
+    }
+    else
+    {
+      counters.reallocs++;
+    }
+    return __real_realloc(ptr, size);
+  }
+
+  void __wrap_free(void *ptr)
+  {
+    if (ptr != NULL)
+    {
+      counters.frees++;
+    }
+    __real_free(ptr);
+  }
+}
+
+bool heapCountersEnabled()
+{
+  return true;
+}
+
+HeapCounters heapCounters()
+{
+  return counters;
+}
+#else
+bool heapCountersEnabled()
+{
+  return false;
+}
+
+HeapCounters heapCounters()
+{
+  HeapCounters none = {0, 0, 0};
+  return none;
+}
+#endif
+
+void printRamReport(Print &out)
+{
+  out.printf_P(PSTR("RAM data: %u rodata: %u bss: %u static total: %u\n"),
+               (unsigned)(&_data_end - &_data_start), (unsigned)(&_rodata_end - &_rodata_start),
+               (unsigned)(&_bss_end - &_bss_start), (unsigned)(&_heap_start - &_data_start));
+  out.printf_P(PSTR("Heap free: %u max block: %u fragmentation: %u%%\n"),
+               ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation());
+  if (heapCountersEnabled())
+  {
+    HeapCounters c = heapCounters();
+    out.printf_P(PSTR("Heap allocs: %lu reallocs: %lu frees: %lu\n"), c.allocs, c.reallocs, c.frees);
+  }
+  else
+  {
+    out.println(F("Heap allocs: not counted, build with HEAP_COUNTERS"));
+  }
+}
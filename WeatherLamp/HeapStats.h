@@ -0,0 +1,35 @@
+/**************************************************************************************
+   Heap allocation counters and RAM budget report
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   After setup() the sketch shouldn't allocate at all, so counters that stop
+   moving are the proof it can run for months without fragmenting the heap.
+   Counting needs HEAP_COUNTERS defined and malloc, calloc, realloc and free
+   wrapped at link time (-Wl,--wrap=malloc etc., build env:d1_mini_heapstats
+   in platformio.ini). That covers the sketch, libraries, core and new/delete,
+   but not what the WiFi SDK allocates internally. The counters aren't
+   interrupt safe, so they are for diagnostic builds, not releases.
+
+ **************************************************************************************/
+
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <Arduino.h>
+
+struct HeapCounters
+{
+  unsigned long allocs;   // malloc, calloc and realloc(NULL, n)
+  unsigned long reallocs; // Resizing an existing block
+  unsigned long frees;    // free and realloc(p, 0)
+};
+
+// True if the firmware was linked with the allocation wrappers
+bool heapCountersEnabled();
+// Counts since boot, all 0 without HEAP_COUNTERS
+HeapCounters heapCounters();
+// Static RAM by section, free heap, largest free block and the counters
+void printRamReport(Print &out);
+
+#endif
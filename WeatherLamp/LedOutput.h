@@ -0,0 +1,95 @@
+/**************************************************************************************
+   LED output backends
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   FastLED's clockless ESP8266 driver bit-bangs WS2812 data with interrupts off,
+   about 30 us per LED on every show(). With a few hundred LEDs that starves the
+   WiFi stack. The hardware backends hand the frame to UART1 or I2S DMA instead:
+   show() converts leds[] into the driver's buffer and returns while the
+   hardware sends it, so the transfer overlaps with rendering the next frame.
+   leds[] is the back buffer the effects render into and the driver's buffer
+   is the front one on the wire, so frames take max(render, transmit) instead
+   of their sum.
+
+   LED_OUTPUT is chosen in settings.h. This header uses LED_TYPE, LED_PIN and
+   COLOR_ORDER from there, so include it after settings.h.
+
+ **************************************************************************************/
+
+#ifndef LED_OUTPUT_H
+#define LED_OUTPUT_H
+
+#include <FastLED.h>
+
+#define LED_OUTPUT_FASTLED 0 // FastLED driver for LED_TYPE on LED_PIN, any chipset
+#define LED_OUTPUT_UART1 1   // WS2812 over async UART1, fixed to GPIO2 (D4)
+#define LED_OUTPUT_DMA 2     // WS2812 over I2S DMA, fixed to GPIO3 (RX), no serial commands
+
+#ifndef LED_OUTPUT
+#define LED_OUTPUT LED_OUTPUT_FASTLED
+#endif
+
+#if LED_OUTPUT != LED_OUTPUT_FASTLED
+#include <NeoPixelBus.h>
+// Byte order of the strip, NeoPixelBus' equivalent of COLOR_ORDER
+#ifndef LED_NEO_FEATURE
+#define LED_NEO_FEATURE NeoGrbFeature
+#endif
+#if LED_OUTPUT == LED_OUTPUT_UART1
+#define LED_NEO_METHOD NeoEsp8266AsyncUart1800KbpsMethod
+#else
+#define LED_NEO_METHOD NeoEsp8266Dma800KbpsMethod
+#endif
+#endif
+
+template <uint16_t N>
+class LedOutput
+{
+public:
+#if LED_OUTPUT == LED_OUTPUT_FASTLED
+  void begin(CRGB *leds)
+  {
+    FastLED.addLeds<LED_TYPE, LED_PIN, COLOR_ORDER>(leds, N).setCorrection(TypicalLEDStrip);
+    // FastLED.addLeds<LED_TYPE, LED_PIN, CLK_PIN, COLOR_ORDER>(leds, N).setCorrection( TypicalLEDStrip );
+  }
+  // Blocks until the whole frame has been sent
+  void show() { FastLED.show(); }
+  bool ready() { return true; }
+#else
+  LedOutput() : _leds(NULL), _strip(N) {}
+
+  // Call after Serial.begin(), which would otherwise take the RX pin back from I2S
+  void begin(CRGB *leds)
+  {
+    _leds = leds;
+    _strip.Begin();
+  }
+
+  /**
+     Apply FastLED's global brightness and the TypicalLEDStrip correction, copy
+     the frame to the driver and start sending it. Waits only if the previous
+     frame is still on the wire.
+  */
+  void show()
+  {
+    CRGB scale = CLEDController::computeAdjustment(FastLED.getBrightness(), CRGB(TypicalLEDStrip),
+                                                   CRGB(UncorrectedTemperature));
+    for (uint16_t i = 0; i < N; i++)
+    {
+      const CRGB &c = _leds[i];
+      _strip.SetPixelColor(i, RgbColor(scale8(c.r, scale.r), scale8(c.g, scale.g), scale8(c.b, scale.b)));
+    }
+    _strip.Show();
+  }
+
+  // False while the previous frame is still being sent, show() would wait for it
+  bool ready() { return _strip.CanShow(); }
+
+private:
+  CRGB *_leds;
+  NeoPixelBus<LED_NEO_FEATURE, LED_NEO_METHOD> _strip;
+#endif
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "Metrics.h"
+#include "HeapStats.h"
+#include <stdarg.h>
+
+// Connect and transfer of a ~100 byte payload, FETCH_TIMEOUT_MS is the upper limit
+static const unsigned long FETCH_BOUNDS_US[] = {10000, 25000, 50000, 100000, 250000, 500000, 1000000, 5000000};
+
+// Room for the longest name and HELP text below, longer ones would be truncated
+#define METRICS_NAME_MAX 48
+#define METRICS_HELP_MAX 64
+
+static const char GAUGE[] PROGMEM = "gauge";
+static const char COUNTER[] PROGMEM = "counter";
+static const char HISTOGRAM[] PROGMEM = "histogram";
+
+struct MetricsOut
+{
+  char *buf;
+  size_t size;
+  size_t len;
+  bool full;
+};
+
+/**
+   Append a line formatted from a PSTR() format. Once a line doesn't fit nothing
+   more is added, so a too small buffer truncates the output at a line boundary.
+*/
+static void put(MetricsOut &out, PGM_P format, ...)
+{
+  if (out.full)
+  {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf_P(out.buf + out.len, out.size - out.len, format, args);
+  va_end(args);
+  if (n > 0 && out.len + n < out.size)
+  {
+    out.len += n;
+  }
+  else
+  {
+    out.buf[out.len] = '\0';
+    out.full = true;
+  }
+}
+
+/**
+   RAM copy of a PROGMEM string, for passing to %s
+*/
+template <size_t N>
+static const char *ram(char (&dest)[N], PGM_P src)
+{
+  strncpy_P(dest, src, N - 1);
+  dest[N - 1] = '\0';
+  return dest;
+}
+
+static void describe(MetricsOut &out, const char *name, PGM_P type, PGM_P help)
+{
+  char typeBuf[12];
+  char helpBuf[METRICS_HELP_MAX];
+  put(out, PSTR("# HELP %s %s\n# TYPE %s %s\n"), name, ram(helpBuf, help), name, ram(typeBuf, type));
+}
+
+static void histogram(MetricsOut &out, PGM_P pname, PGM_P help, const DurationHistogram &h)
+{
+  char name[METRICS_NAME_MAX];
+  ram(name, pname);
+  describe(out, name, HISTOGRAM, help);
+  unsigned long cumulative = 0;
+  for (uint8_t i = 0; i < h.size; i++)
+  {
+    cumulative += h.counts[i];
+    put(out, PSTR("%s_bucket{le=\"%lu.%06lu\"} %lu\n"), name, h.bounds[i] / 1000000, h.bounds[i] % 1000000,
+        cumulative);
+  }
+  put(out, PSTR("%s_bucket{le=\"+Inf\"} %lu\n"), name, h.count);
+  put(out, PSTR("%s_sum %lu.%06lu\n"), name, (unsigned long)(h.sum / 1000000), (unsigned long)(h.sum % 1000000));
+  put(out, PSTR("%s_count %lu\n"), name, h.count);
+}
+
+static void single(MetricsOut &out, PGM_P pname, PGM_P type, PGM_P help, unsigned long value)
+{
+  char name[METRICS_NAME_MAX];
+  ram(name, pname);
+  describe(out, name, type, help);
+  put(out, PSTR("%s %lu\n"), name, value);
+}
+
+Metrics::Metrics()
+    : _fetchLatency(FETCH_BOUNDS_US, sizeof(FETCH_BOUNDS_US) / sizeof(FETCH_BOUNDS_US[0])),
+      _statusCount(0), _statusOther(0), _fetchFailures(0)
+{
+}
+
+void Metrics::fetchFinished(int status, unsigned long latencyUs, bool ok)
+{
+  if (ok)
+  {
+    _fetchLatency.add(latencyUs);
+  }
+  else
+  {
+    _fetchFailures++;
+  }
+  if (status == 0)
+  {
+    return;
+  }
+  for (uint8_t i = 0; i < _statusCount; i++)
+  {
+    if (_statuses[i].status == status)
+    {
+      _statuses[i].count++;
+      return;
+    }
+  }
+  if (_statusCount < METRICS_STATUS_CODES)
+  {
+    _statuses[_statusCount].status = status;
+    _statuses[_statusCount].count = 1;
+    _statusCount++;
+  }
+  else
+  {
+    _statusOther++;
+  }
+}
+
+size_t Metrics::write(char *buf, size_t size, const FrameTimer &frameTimer, unsigned long fetchBytes)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  MetricsOut out = {buf, size, 0, false};
+  buf[0] = '\0';
+
+  single(out, PSTR("weatherlamp_uptime_seconds"), GAUGE, PSTR("Time since boot"),
+         (unsigned long)(micros64() / 1000000));
+  single(out, PSTR("weatherlamp_frames_total"), COUNTER, PSTR("Rendered frames"), frameTimer.frameHistogram().count);
+  single(out, PSTR("weatherlamp_frames_missed_total"), COUNTER, PSTR("Frame deadlines missed"),
+         frameTimer.missedTotal());
+  histogram(out, PSTR("weatherlamp_frame_duration_seconds"), PSTR("Work done per frame"), frameTimer.frameHistogram());
+  histogram(out, PSTR("weatherlamp_show_duration_seconds"), PSTR("FastLED.show() duration"),
+            frameTimer.showHistogram());
+
+  single(out, PSTR("weatherlamp_heap_free_bytes"), GAUGE, PSTR("Free heap"), ESP.getFreeHeap());
+  single(out, PSTR("weatherlamp_heap_max_block_bytes"), GAUGE, PSTR("Largest free heap block"),
+         ESP.getMaxFreeBlockSize());
+  single(out, PSTR("weatherlamp_heap_fragmentation_percent"), GAUGE, PSTR("Heap fragmentation"),
+         ESP.getHeapFragmentation());
+  if (heapCountersEnabled())
+  {
+    HeapCounters heap = heapCounters();
+    single(out, PSTR("weatherlamp_heap_allocs_total"), COUNTER, PSTR("malloc, calloc and new calls"), heap.allocs);
+    single(out, PSTR("weatherlamp_heap_reallocs_total"), COUNTER, PSTR("realloc calls resizing a block"),
+           heap.reallocs);
+    single(out, PSTR("weatherlamp_heap_frees_total"), COUNTER, PSTR("free and delete calls"), heap.frees);
+  }
+
+  histogram(out, PSTR("weatherlamp_fetch_duration_seconds"), PSTR("Palette fetch connect and transfer time"),
+            _fetchLatency);
+  char name[METRICS_NAME_MAX];
+  describe(out, ram(name, PSTR("weatherlamp_fetch_responses_total")), COUNTER,
+           PSTR("Palette fetch responses by HTTP status"));
+  for (uint8_t i = 0; i < _statusCount; i++)
+  {
+    put(out, PSTR("weatherlamp_fetch_responses_total{code=\"%d\"} %lu\n"), _statuses[i].status, _statuses[i].count);
+  }
+  if (_statusOther)
+  {
+    put(out, PSTR("weatherlamp_fetch_responses_total{code=\"other\"} %lu\n"), _statusOther);
+  }
+  single(out, PSTR("weatherlamp_fetch_failures_total"), COUNTER, PSTR("Failed palette fetches"), _fetchFailures);
+  single(out, PSTR("weatherlamp_fetch_received_bytes_total"), COUNTER, PSTR("Bytes received by palette fetches"),
+         fetchBytes);
+  return out.len;
+}
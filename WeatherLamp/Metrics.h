@@ -0,0 +1,53 @@
+/**************************************************************************************
+   Runtime counters in Prometheus text format
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Frame, show() and fetch timings, heap state and download counters. The
+   exposition is formatted into a caller supplied buffer, names, HELP texts and
+   formats stay in flash. Formatting doesn't allocate, but ESP8266WebServer
+   builds the request and response headers as Strings, so every scrape still
+   does a few small heap allocations (weatherlamp_heap_allocs_total shows them,
+   in a build with HEAP_COUNTERS).
+
+ **************************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include "FrameTimer.h"
+
+#ifndef METRICS_PORT
+#define METRICS_PORT 9100
+#endif
+#define METRICS_BUF_SIZE 4096 // Full output is about 3.5 kB
+// Distinct HTTP status codes counted separately, the rest go to code="other"
+#define METRICS_STATUS_CODES 6
+
+class Metrics
+{
+public:
+  Metrics();
+  // Record a finished palette fetch. status is 0 if no response was received, ok is false
+  // also when a response arrived but its palette couldn't be decoded.
+  void fetchFinished(int status, unsigned long latencyUs, bool ok);
+  // Write all metrics into buf, returns the length without the terminating NUL.
+  // fetchBytes is the transport's bytesReceived().
+  size_t write(char *buf, size_t size, const FrameTimer &frameTimer, unsigned long fetchBytes);
+
+private:
+  struct StatusCount
+  {
+    int status;
+    unsigned long count;
+  };
+
+  DurationHistogram _fetchLatency;
+  StatusCount _statuses[METRICS_STATUS_CODES];
+  uint8_t _statusCount;
+  unsigned long _statusOther;
+  unsigned long _fetchFailures;
+};
+
+#endif
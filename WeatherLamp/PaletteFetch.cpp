@@ -0,0 +1,385 @@
+#include "PaletteFetch.h"
+
+PaletteFetch::PaletteFetch()
+    : _state(FETCH_IDLE), _server(80), _connected(false), _disconnected(false), _rxOverflow(false), _reused(false),
+      _keepAlive(false), _startedAt(0), _startUs(0), _sentUs(0), _connectUs(0), _transferUs(0), _rxHead(0), _rxTail(0),
+      _lineLen(0), _bytesReceived(0), _status(0), _contentLength(-1), _maxAge(0), _retryAfter(0), _chunked(false),
+      _bodyLen(0)
+{
+  _etag[0] = '\0';
+  _lastModified[0] = '\0';
+  _newEtag[0] = '\0';
+  _newLastModified[0] = '\0';
+  _client.onConnect([](void *arg, AsyncClient *c) {
+    ((PaletteFetch *)arg)->_connected = true;
+  }, this);
+  _client.onData([](void *arg, AsyncClient *c, void *data, size_t len) {
+    ((PaletteFetch *)arg)->rxPush((const uint8_t *)data, len);
+  }, this);
+  _client.onDisconnect([](void *arg, AsyncClient *c) {
+    ((PaletteFetch *)arg)->_disconnected = true;
+  }, this);
+  _client.onError([](void *arg, AsyncClient *c, int8_t error) {
+    ((PaletteFetch *)arg)->_disconnected = true;
+  }, this);
+}
+
+bool PaletteFetch::setUrl(const char *url)
+{
+  if (!_server.setUrl(url, "http://"))
+  {
+    return false;
+  }
+  if (_state == FETCH_IDLE)
+  {
+    _client.close(true); // A kept-alive connection may be to the old server
+    _connected = false;
+  }
+  return true;
+}
+
+bool PaletteFetch::start()
+{
+  if (_state != FETCH_IDLE || !_server.isSet())
+  {
+    return false;
+  }
+  _rxOverflow = false;
+  _rxHead = _rxTail = 0;
+  _lineLen = 0;
+  _status = 0;
+  _keepAlive = false;
+  _contentLength = -1;
+  _maxAge = 0;
+  _retryAfter = 0;
+  _chunked = false;
+  _bodyLen = 0;
+  _newEtag[0] = '\0';
+  _newLastModified[0] = '\0';
+  _startedAt = millis();
+  _startUs = micros();
+  _connectUs = 0;
+  _transferUs = 0;
+
+  if (_connected && !_disconnected && _client.connected())
+  {
+    // Previous response left the connection open
+    _reused = true;
+    _state = FETCH_SEND;
+    return true;
+  }
+  _reused = false;
+  beginConnect();
+  return _state != FETCH_IDLE;
+}
+
+/**
+   Open a new connection, using the cached address if it hasn't expired
+*/
+void PaletteFetch::beginConnect()
+{
+  _client.close(true);
+  _connected = false;
+  _disconnected = false;
+  _state = FETCH_RESOLVE;
+  if (!_server.resolve())
+  {
+    fail(F("DNS lookup"));
+  }
+}
+
+void PaletteFetch::accept()
+{
+  strcpy(_etag, _newEtag);
+  strcpy(_lastModified, _newLastModified);
+}
+
+FetchResult PaletteFetch::poll(unsigned long budgetUs)
+{
+  if (_state == FETCH_IDLE)
+  {
+    return FETCH_PENDING;
+  }
+  unsigned long sliceStart = micros();
+  if (millis() - _startedAt > FETCH_TIMEOUT_MS)
+  {
+    fail(F("timeout"));
+    return FETCH_FAILED;
+  }
+  if (_rxOverflow)
+  {
+    fail(F("receive buffer overflow"));
+    return FETCH_FAILED;
+  }
+
+  switch (_state)
+  {
+  case FETCH_RESOLVE:
+    if (!_server.resolved())
+    {
+      return FETCH_PENDING;
+    }
+    if (!_server.found())
+    {
+      fail(F("DNS lookup"));
+      return FETCH_FAILED;
+    }
+    if (!_client.connect(_server.addr(), _server.port()))
+    {
+      _server.forget(); // Server may have moved, resolve again next time
+      fail(F("connect"));
+      return FETCH_FAILED;
+    }
+    _state = FETCH_CONNECT;
+    return FETCH_PENDING;
+
+  case FETCH_CONNECT:
+    if (_disconnected)
+    {
+      _server.forget();
+      fail(F("connect"));
+      return FETCH_FAILED;
+    }
+    if (!_connected)
+    {
+      return FETCH_PENDING;
+    }
+    _connectUs = micros() - _startUs;
+    _state = FETCH_SEND;
+    // fall through
+  case FETCH_SEND:
+    sendRequest();
+    return _state == FETCH_IDLE ? FETCH_FAILED : FETCH_PENDING;
+
+  case FETCH_RECV_HEADERS:
+    while (micros() - sliceStart < budgetUs && readLine())
+    {
+      if (_status == 0)
+      {
+        // Status line, e.g. "HTTP/1.1 200 OK"
+        const char *code = strchr(_line, ' ');
+        _status = code ? atoi(code + 1) : -1;
+        _keepAlive = strncmp(_line, "HTTP/1.1 ", 9) == 0;
+      }
+      else if (_line[0] != '\0')
+      {
+        parseHeader();
+      }
+      else if (_status == 304)
+      {
+        finish(_keepAlive);
+        return FETCH_NOT_MODIFIED;
+      }
+      else if (_status != 200 || _chunked || _contentLength > FETCH_BODY_MAX)
+      {
+        fail(F("unexpected response"));
+        return FETCH_FAILED;
+      }
+      else
+      {
+        _state = FETCH_RECV_BODY;
+        break;
+      }
+    }
+    if (_state == FETCH_RECV_HEADERS)
+    {
+      if (_disconnected && _rxHead == _rxTail)
+      {
+        if (_reused && _status == 0 && _lineLen == 0)
+        {
+          // Server closed the idle keep-alive connection, retry on a new one
+          _reused = false;
+          beginConnect();
+          return _state == FETCH_IDLE ? FETCH_FAILED : FETCH_PENDING;
+        }
+        fail(F("connection closed"));
+        return FETCH_FAILED;
+      }
+      return FETCH_PENDING;
+    }
+    // fall through
+  case FETCH_RECV_BODY:
+    while (_contentLength < 0 || _bodyLen < _contentLength)
+    {
+      int c = rxPop();
+      if (c < 0)
+      {
+        break;
+      }
+      if (_bodyLen == FETCH_BODY_MAX)
+      {
+        fail(F("body too long"));
+        return FETCH_FAILED;
+      }
+      _body[_bodyLen++] = c;
+    }
+    {
+      // Without Content-Length the body ends when the server closes the connection
+      bool drained = _disconnected && _rxHead == _rxTail;
+      if (_contentLength >= 0 ? _bodyLen < _contentLength : !drained)
+      {
+        if (drained)
+        {
+          fail(F("connection closed"));
+          return FETCH_FAILED;
+        }
+        return FETCH_PENDING;
+      }
+    }
+    _state = FETCH_COMMIT;
+    // fall through
+  case FETCH_COMMIT:
+    // Caller decodes body() and commits the palette. Without Content-Length
+    // the server has closed the connection to end the body.
+    finish(_keepAlive && _contentLength >= 0);
+    return FETCH_UPDATED;
+
+  default:
+    return FETCH_PENDING;
+  }
+}
+
+void PaletteFetch::sendRequest()
+{
+  char req[FETCH_PATH_MAX + FETCH_HOST_MAX + 256];
+  int len = snprintf(req, sizeof(req),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: WeatherLamp\r\nConnection: keep-alive\r\n",
+                     _server.path(), _server.host());
+  if (_etag[0] != '\0')
+  {
+    len += snprintf(req + len, sizeof(req) - len, "If-None-Match: %s\r\n", _etag);
+  }
+  if (_lastModified[0] != '\0')
+  {
+    len += snprintf(req + len, sizeof(req) - len, "If-Modified-Since: %s\r\n", _lastModified);
+  }
+  len += snprintf(req + len, sizeof(req) - len, "\r\n");
+  if (len >= (int)sizeof(req) || _client.write(req, len) != (size_t)len)
+  {
+    fail(F("send"));
+    return;
+  }
+  _sentUs = micros();
+  _state = FETCH_RECV_HEADERS;
+}
+
+/**
+   Read one header line from the receive buffer into _line, without the CRLF.
+   Returns false if the line isn't complete yet.
+*/
+bool PaletteFetch::readLine()
+{
+  int c;
+  while ((c = rxPop()) >= 0)
+  {
+    if (c == '\n')
+    {
+      if (_lineLen > 0 && _line[_lineLen - 1] == '\r')
+      {
+        _lineLen--;
+      }
+      _line[_lineLen] = '\0';
+      _lineLen = 0;
+      return true;
+    }
+    if (_lineLen < sizeof(_line) - 1)
+    {
+      _line[_lineLen++] = c;
+    }
+  }
+  return false;
+}
+
+/**
+   Pick the headers we care about from _line
+*/
+void PaletteFetch::parseHeader()
+{
+  const char *value = strchr(_line, ':');
+  if (value == NULL)
+  {
+    return;
+  }
+  value++;
+  while (*value == ' ')
+  {
+    value++;
+  }
+  if (strncasecmp(_line, "Content-Length:", 15) == 0)
+  {
+    _contentLength = atol(value);
+  }
+  else if (strncasecmp(_line, "Transfer-Encoding:", 18) == 0)
+  {
+    _chunked = strcasecmp(value, "identity") != 0;
+  }
+  else if (strncasecmp(_line, "Cache-Control:", 14) == 0)
+  {
+    const char *maxAge = strstr(value, "max-age=");
+    if (maxAge != NULL)
+    {
+      _maxAge = strtoul(maxAge + 8, NULL, 10);
+    }
+  }
+  else if (strncasecmp(_line, "Retry-After:", 12) == 0)
+  {
+    _retryAfter = strtoul(value, NULL, 10); // HTTP-date form isn't supported, reads as 0
+  }
+  else if (strncasecmp(_line, "Connection:", 11) == 0)
+  {
+    _keepAlive = strcasecmp(value, "close") != 0;
+  }
+  else if (strncasecmp(_line, "ETag:", 5) == 0)
+  {
+    strlcpy(_newEtag, value, sizeof(_newEtag));
+  }
+  else if (strncasecmp(_line, "Last-Modified:", 14) == 0)
+  {
+    strlcpy(_newLastModified, value, sizeof(_newLastModified));
+  }
+}
+
+void PaletteFetch::rxPush(const uint8_t *data, size_t len)
+{
+  _bytesReceived += len;
+  if (_rxHead - _rxTail + len > FETCH_RX_SIZE)
+  {
+    _rxOverflow = true;
+    return;
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    _rx[_rxHead++ % FETCH_RX_SIZE] = data[i];
+  }
+}
+
+int PaletteFetch::rxPop()
+{
+  if (_rxHead == _rxTail)
+  {
+    return -1;
+  }
+  return _rx[_rxTail++ % FETCH_RX_SIZE];
+}
+
+void PaletteFetch::fail(const __FlashStringHelper *reason)
+{
+  Serial.print(F("Palette fetch failed: "));
+  Serial.println(reason);
+  finish(false);
+}
+
+void PaletteFetch::finish(bool keepOpen)
+{
+  if (_sentUs != 0)
+  {
+    _transferUs = micros() - _sentUs;
+    _sentUs = 0;
+  }
+  if (!keepOpen)
+  {
+    _client.close(true);
+    _connected = false;
+  }
+  _state = FETCH_IDLE;
+}
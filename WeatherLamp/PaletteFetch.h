@@ -0,0 +1,125 @@
+/**************************************************************************************
+   Non-blocking HTTP fetch of the palette payload
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   The fetch is split into explicit steps (resolve, connect, send, receive headers,
+   receive body, commit) and advanced by poll(), which is called once per frame
+   from loop() and returns after at most its time budget. DNS resolution and
+   TCP connect are asynchronous (lwIP DNS + ESPAsyncTCP), received bytes are
+   queued by the TCP callback and parsed in poll(). Nothing is allocated from
+   the heap after construction.
+
+   The connection is kept alive between fetches when the server allows it, and
+   the resolved address is cached for FETCH_DNS_TTL_MS, so a typical poll is a
+   single request/response on an open socket.
+
+ **************************************************************************************/
+
+#ifndef PALETTE_FETCH_H
+#define PALETTE_FETCH_H
+
+#include <Arduino.h>
+#include <ESPAsyncTCP.h>
+#include "FetchHost.h"
+#include "PaletteFormat.h"
+
+#define FETCH_BODY_MAX PALETTE_PAYLOAD_MAX
+#define FETCH_RX_SIZE 1024  // Received but not yet parsed bytes
+#define FETCH_LINE_MAX 128  // Longer header lines are truncated
+#define FETCH_TIMEOUT_MS 5000
+
+enum FetchState
+{
+  FETCH_IDLE,
+  FETCH_RESOLVE,
+  FETCH_CONNECT,
+  FETCH_SEND,
+  FETCH_RECV_HEADERS,
+  FETCH_RECV_BODY,
+  FETCH_COMMIT
+};
+
+enum FetchResult
+{
+  FETCH_PENDING,      // Nothing finished during this poll()
+  FETCH_UPDATED,      // New body is available via body() / bodyLength()
+  FETCH_NOT_MODIFIED, // Server answered 304, keep the current palette
+  FETCH_FAILED
+};
+
+class PaletteFetch
+{
+public:
+  PaletteFetch();
+  // Parse a http://host[:port]/path URL, returns false if it isn't one
+  bool setUrl(const char *url);
+  // Start a new fetch, returns false if one is already in flight
+  bool start();
+  // Advance the fetch, spending at most budgetUs microseconds
+  FetchResult poll(unsigned long budgetUs);
+  bool idle() const { return _state == FETCH_IDLE; }
+  FetchState state() const { return _state; }
+  int status() const { return _status; }
+  const uint8_t *body() const { return _body; }
+  int bodyLength() const { return _bodyLen; }
+  // Timing of the last finished fetch: resolve + connect (0 when the
+  // connection was reused) and request sent to response complete
+  unsigned long connectUs() const { return _connectUs; }
+  unsigned long transferUs() const { return _transferUs; }
+  bool reused() const { return _reused; }
+  // All bytes received since boot, headers included
+  unsigned long bytesReceived() const { return _bytesReceived; }
+  // Cache-Control: max-age and Retry-After of the last response in seconds, 0 if not sent
+  unsigned long maxAge() const { return _maxAge; }
+  unsigned long retryAfter() const { return _retryAfter; }
+  // Call after FETCH_UPDATED once the body has been decoded successfully,
+  // so the next request is conditional on this response's ETag/Last-Modified
+  void accept();
+
+private:
+  void beginConnect();
+  void fail(const __FlashStringHelper *reason);
+  void finish(bool keepOpen);
+  bool readLine();
+  void parseHeader();
+  void sendRequest();
+  void rxPush(const uint8_t *data, size_t len);
+  int rxPop();
+
+  FetchState _state;
+  AsyncClient _client;
+  FetchHost _server;
+  bool _connected;
+  bool _disconnected;
+  bool _rxOverflow;
+  bool _reused;
+  bool _keepAlive;
+  unsigned long _startedAt;
+  unsigned long _startUs;
+  unsigned long _sentUs;
+  unsigned long _connectUs;
+  unsigned long _transferUs;
+
+  uint8_t _rx[FETCH_RX_SIZE];
+  size_t _rxHead; // Next write position
+  size_t _rxTail; // Next read position
+  char _line[FETCH_LINE_MAX];
+  size_t _lineLen;
+  unsigned long _bytesReceived;
+
+  int _status;
+  long _contentLength;
+  unsigned long _maxAge;
+  unsigned long _retryAfter;
+  bool _chunked;
+  uint8_t _body[FETCH_BODY_MAX];
+  int _bodyLen;
+  // Validators of the last palette we got, sent back to make fetches conditional
+  char _etag[64];
+  char _lastModified[40];
+  char _newEtag[64];
+  char _newLastModified[40];
+};
+
+#endif
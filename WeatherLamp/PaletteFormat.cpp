@@ -0,0 +1,89 @@
+#include "PaletteFormat.h"
+
+uint16_t readU16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t readU32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void writeU32(uint8_t *p, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    p[i] = value >> (8 * i);
+  }
+}
+
+PaletteError parsePalettePayload(const uint8_t *buf, size_t len, PaletteHeader &header)
+{
+  if (len < PALETTE_HEADER_SIZE + PALETTE_CRC_SIZE)
+  {
+    return PALETTE_TOO_SHORT;
+  }
+  if (buf[0] != 'W' || buf[1] != 'L')
+  {
+    return PALETTE_BAD_MAGIC;
+  }
+  header.version = buf[2];
+  header.headerSize = buf[3];
+  header.slots = buf[4];
+  header.flags = buf[5];
+  if (header.version != PALETTE_FORMAT_VERSION || header.headerSize < PALETTE_HEADER_SIZE)
+  {
+    return PALETTE_BAD_VERSION;
+  }
+  if (len != (size_t)header.headerSize + 3 * header.slots + PALETTE_CRC_SIZE)
+  {
+    return PALETTE_BAD_LENGTH;
+  }
+  if (paletteCrc32(buf, len - PALETTE_CRC_SIZE) != readU32(buf + len - PALETTE_CRC_SIZE))
+  {
+    return PALETTE_BAD_CRC;
+  }
+  header.baseTime = readU32(buf + 6);
+  header.slotMinutes = readU16(buf + 10);
+  header.validMinutes = readU16(buf + 12);
+  return PALETTE_OK;
+}
+
+const char *paletteErrorName(PaletteError error)
+{
+  switch (error)
+  {
+  case PALETTE_OK:
+    return "ok";
+  case PALETTE_TOO_SHORT:
+    return "too short";
+  case PALETTE_BAD_MAGIC:
+    return "bad magic";
+  case PALETTE_BAD_VERSION:
+    return "unsupported version";
+  case PALETTE_BAD_LENGTH:
+    return "bad length";
+  case PALETTE_BAD_CRC:
+    return "bad CRC";
+  }
+  return "unknown";
+}
+
+/**
+   Bitwise CRC-32 (IEEE 802.3, same as zlib.crc32). Payloads are tens of bytes,
+   so a 1 kB lookup table isn't worth the RAM.
+*/
+uint32_t paletteCrc32(const uint8_t *buf, size_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= buf[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,70 @@
+/**************************************************************************************
+   Binary palette payload shared by the firmware and the Python generators
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   The encoder lives in py/palettefile.py, keep the two in sync.
+   All multi-byte fields are little-endian.
+
+   offset  size  field
+        0     2  magic "WL"
+        2     1  version (PALETTE_FORMAT_VERSION)
+        3     1  header size, offset of the first colour. Newer generators may
+                 append fields to the header without breaking older lamps.
+        4     1  slot count
+        5     1  flags, reserved (0)
+        6     4  base time, start of the first slot (Unix time, seconds)
+       10     2  slot length (minutes)
+       12     2  validity, minutes after base time the payload may be shown
+       14  3*n   slot colours, packed RGB
+      end     4  CRC-32 (as zlib.crc32) of all preceding bytes
+
+ **************************************************************************************/
+
+#ifndef PALETTE_FORMAT_H
+#define PALETTE_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PALETTE_FORMAT_VERSION 1
+#define PALETTE_HEADER_SIZE 14
+#define PALETTE_CRC_SIZE 4
+// 48 hours of 30 minute slots
+#define PALETTE_MAX_SLOTS 96
+#define PALETTE_PAYLOAD_MAX (PALETTE_HEADER_SIZE + 3 * PALETTE_MAX_SLOTS + PALETTE_CRC_SIZE)
+
+struct PaletteHeader
+{
+  uint8_t version;
+  uint8_t headerSize;
+  uint8_t slots;
+  uint8_t flags;
+  uint32_t baseTime;
+  uint16_t slotMinutes;
+  uint16_t validMinutes;
+};
+
+enum PaletteError
+{
+  PALETTE_OK,
+  PALETTE_TOO_SHORT,
+  PALETTE_BAD_MAGIC,
+  PALETTE_BAD_VERSION,
+  PALETTE_BAD_LENGTH,
+  PALETTE_BAD_CRC
+};
+
+// Validate a payload and parse its header. Cheap checks (magic, version,
+// length) are done before the CRC. Colours of a valid payload start at
+// buf + header.headerSize.
+PaletteError parsePalettePayload(const uint8_t *buf, size_t len, PaletteHeader &header);
+const char *paletteErrorName(PaletteError error);
+uint32_t paletteCrc32(const uint8_t *buf, size_t len);
+
+// Little-endian fields, for this format and the UDP fetch and relay packets
+uint16_t readU16(const uint8_t *p);
+uint32_t readU32(const uint8_t *p);
+void writeU32(uint8_t *p, uint32_t value);
+
+#endif
@@ -0,0 +1,49 @@
+#include "PaletteLut.h"
+
+PaletteLut::PaletteLut() : _brightness(0), _blending(LINEARBLEND), _valid(false)
+{
+}
+
+bool PaletteLut::update(const CRGBPalette16 &palette, uint8_t brightness, TBlendType blending)
+{
+  uint16_t changed = 0;
+  if (!_valid || brightness != _brightness || blending != _blending)
+  {
+    changed = 0xFFFF;
+  }
+  else
+  {
+    for (uint8_t i = 0; i < 16; i++)
+    {
+      if (palette[i] != _palette[i])
+      {
+        changed |= 1 << i;
+      }
+    }
+    if (changed == 0)
+    {
+      return false;
+    }
+  }
+  _palette = palette;
+  _brightness = brightness;
+  _blending = blending;
+  _valid = true;
+  // Block n (indexes 16n..16n+15) blends entry n into entry n+1, and the last one back into entry 0
+  for (uint8_t block = 0; block < 16; block++)
+  {
+    if (changed & (1 << block | 1 << ((block + 1) & 15)))
+    {
+      rebuildBlock(block);
+    }
+  }
+  return true;
+}
+
+void PaletteLut::rebuildBlock(uint8_t block)
+{
+  for (uint16_t i = block * 16; i < block * 16 + 16; i++)
+  {
+    _entries[i] = ColorFromPalette(_palette, i, _brightness, _blending);
+  }
+}
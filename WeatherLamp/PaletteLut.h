@@ -0,0 +1,59 @@
+/**************************************************************************************
+   Palette expanded to a 256-entry RGB lookup table
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   ColorFromPalette() blends two of the 16 palette entries and scales the result
+   by brightness on every call. The palette changes at most once per fetch, so
+   the whole gradient is expanded once and rendering becomes a table load.
+   While a palette fades, only the 16-entry blocks next to changed palette
+   entries are rebuilt.
+
+ **************************************************************************************/
+
+#ifndef PALETTE_LUT_H
+#define PALETTE_LUT_H
+
+#include <FastLED.h>
+
+class PaletteLut
+{
+public:
+  PaletteLut();
+  // Rebuild the parts of the table affected by palette entries, brightness or
+  // blending that differ from the ones it was built with. Returns true if the table changed.
+  bool update(const CRGBPalette16 &palette, uint8_t brightness, TBlendType blending);
+  const CRGB &operator[](uint8_t index) const { return _entries[index]; }
+
+private:
+  void rebuildBlock(uint8_t block);
+
+  CRGB _entries[256];
+  CRGBPalette16 _palette;
+  uint8_t _brightness;
+  TBlendType _blending;
+  bool _valid;
+};
+
+// Index of the last palette entry; indexes above it blend back towards entry 0
+#define PALETTE_LUT_SPAN 240
+
+/**
+   Fill N LEDs so that the first one shows startIndex and the last one
+   startIndex + PALETTE_LUT_SPAN, i.e. the whole forecast regardless of strip length.
+   The per-LED step is a rounded 16.16 fixed-point constant computed at compile
+   time, so the error stays below one index step even for thousands of LEDs.
+*/
+template <uint16_t N>
+void fillFromPaletteLut(CRGB *leds, const PaletteLut &lut, uint8_t startIndex)
+{
+  static const uint32_t step = N > 1 ? (((uint32_t)PALETTE_LUT_SPAN << 16) + (N - 1) / 2) / (N - 1) : 0;
+  uint32_t pos = 0x8000; // Round to the nearest index
+  for (uint16_t i = 0; i < N; i++)
+  {
+    leds[i] = lut[(uint8_t)(startIndex + (pos >> 16))];
+    pos += step;
+  }
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include "PaletteRelay.h"
+
+PaletteRelay::PaletteRelay()
+    : _enabled(false), _joined(false), _mayLead(false), _role(RELAY_ROLE_NONE), _id(0), _site(0),
+      _joinedAt(0), _heardAt(0), _sentAt(0), _payloadLen(0)
+{
+}
+
+void PaletteRelay::begin(uint32_t id, uint32_t site, bool mayLead)
+{
+  _id = id;
+  _site = site;
+  _mayLead = mayLead;
+  _enabled = true;
+}
+
+bool PaletteRelay::upstreamAllowed() const
+{
+  if (!_enabled)
+  {
+    return true;
+  }
+  if (!_joined)
+  {
+    return false; // No WiFi, nothing to fetch with anyway
+  }
+  return _role != RELAY_ROLE_FOLLOWER && millis() - _joinedAt >= RELAY_LISTEN_MS;
+}
+
+/**
+   Join the multicast group on the current interface, again after every WiFi reconnect
+*/
+void PaletteRelay::join()
+{
+  if (!_udp.beginMulticast(WiFi.localIP(), RELAY_GROUP, RELAY_PORT))
+  {
+    return;
+  }
+  _joined = true;
+  _joinedAt = _heardAt = millis();
+  _role = RELAY_ROLE_NONE;
+  Serial.println(F("Palette relay listening"));
+}
+
+bool PaletteRelay::poll()
+{
+  if (!_enabled)
+  {
+    return false;
+  }
+  if (WiFi.status() != WL_CONNECTED)
+  {
+    if (_joined)
+    {
+      _udp.stop();
+      _joined = false;
+    }
+    return false;
+  }
+  if (!_joined)
+  {
+    join();
+    return false;
+  }
+
+  unsigned long now = millis();
+  bool updated = false;
+  receive(now, updated);
+
+  switch (_role)
+  {
+  case RELAY_ROLE_FOLLOWER:
+    if (now - _heardAt > RELAY_GATEWAY_TIMEOUT_MS)
+    {
+      Serial.println(F("Relay gateway lost, fetching upstream"));
+      _role = RELAY_ROLE_NONE;
+    }
+    break;
+  case RELAY_ROLE_NONE:
+    if (_mayLead && now - _heardAt > RELAY_GATEWAY_TIMEOUT_MS + _id % RELAY_ELECTION_SPREAD_MS)
+    {
+      Serial.println(F("Relay gateway role taken"));
+      _role = RELAY_ROLE_GATEWAY;
+      send();
+    }
+    break;
+  case RELAY_ROLE_GATEWAY:
+    if (now - _sentAt >= RELAY_BEACON_MS)
+    {
+      send();
+    }
+    break;
+  }
+  return updated;
+}
+
+/**
+   Handle all queued packets. Anything malformed, from another site or from
+   ourselves (multicast loopback) is ignored.
+*/
+void PaletteRelay::receive(unsigned long now, bool &updated)
+{
+  while (_udp.parsePacket() > 0)
+  {
+    int len = _udp.read(_packet, sizeof(_packet));
+    if (len < RELAY_HEADER_SIZE || _packet[0] != 'W' || _packet[1] != 'R' || _packet[2] != RELAY_VERSION ||
+        readU32(_packet + 4) != _site)
+    {
+      continue;
+    }
+    uint32_t sender = readU32(_packet + 8);
+    if (sender == _id)
+    {
+      continue;
+    }
+    if (_role == RELAY_ROLE_GATEWAY)
+    {
+      if (sender > _id)
+      {
+        continue; // It steps down when it hears our next beacon
+      }
+      Serial.println(F("Relay gateway with a lower id found, following it"));
+    }
+    _role = RELAY_ROLE_FOLLOWER;
+    _heardAt = now;
+
+    // Beacons repeat the payload, only report it when it's different
+    int payloadLen = len - RELAY_HEADER_SIZE;
+    const uint8_t *payload = _packet + RELAY_HEADER_SIZE;
+    if (payloadLen > 0 && (payloadLen != _payloadLen || memcmp(payload, _payload, payloadLen) != 0))
+    {
+      memcpy(_payload, payload, payloadLen);
+      _payloadLen = payloadLen;
+      updated = true;
+    }
+  }
+}
+
+void PaletteRelay::publish(const uint8_t *buf, size_t len)
+{
+  if (!_enabled || len > sizeof(_payload))
+  {
+    return;
+  }
+  memcpy(_payload, buf, len);
+  _payloadLen = len;
+  if (_joined && _role == RELAY_ROLE_GATEWAY)
+  {
+    send();
+  }
+}
+
+void PaletteRelay::send()
+{
+  _packet[0] = 'W';
+  _packet[1] = 'R';
+  _packet[2] = RELAY_VERSION;
+  _packet[3] = 0;
+  writeU32(_packet + 4, _site);
+  writeU32(_packet + 8, _id);
+  memcpy(_packet + RELAY_HEADER_SIZE, _payload, _payloadLen);
+  _udp.beginPacketMulticast(RELAY_GROUP, RELAY_PORT, WiFi.localIP());
+  _udp.write(_packet, RELAY_HEADER_SIZE + _payloadLen);
+  _udp.endPacket();
+  _sentAt = millis();
+}
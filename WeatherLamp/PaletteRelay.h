@@ -0,0 +1,99 @@
+/**************************************************************************************
+   LAN palette relay over UDP multicast
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Lamps at the same site (latitude and longitude) elect one gateway. The
+   gateway fetches palettes from the server as usual and multicasts each new
+   payload to the others, which stop polling upstream while they hear it.
+   Beacons repeat the latest payload every RELAY_BEACON_MS, so a lamp that
+   joins later is up to date within one beacon.
+
+   Election: a lamp that hasn't heard a gateway for RELAY_GATEWAY_TIMEOUT_MS
+   (plus a per-lamp delay, so they don't all step up at once) becomes one.
+   If two gateways hear each other, the one with the higher id steps down.
+
+   Packet, little-endian:
+
+   offset  size  field
+        0     2  magic "WR"
+        2     1  version (RELAY_VERSION)
+        3     1  reserved (0)
+        4     4  site, CRC-32 of "latitude,longitude"
+        8     4  sender id
+       12     n  palette payload (see PaletteFormat.h), empty in a beacon
+                 sent before the gateway has one
+
+ **************************************************************************************/
+
+#ifndef PALETTE_RELAY_H
+#define PALETTE_RELAY_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include "PaletteFormat.h"
+
+#define RELAY_OFF 0      // Every lamp fetches on its own
+#define RELAY_AUTO 1     // Take part in the election, may become the gateway
+#define RELAY_FOLLOWER 2 // Listen to a gateway but never become one
+
+#ifndef RELAY_MODE
+#define RELAY_MODE RELAY_OFF
+#endif
+
+#define RELAY_VERSION 1
+#define RELAY_HEADER_SIZE 12
+#define RELAY_PORT 5687
+#define RELAY_GROUP IPAddress(239, 255, 87, 76)
+#define RELAY_BEACON_MS 10000
+#define RELAY_GATEWAY_TIMEOUT_MS (3 * RELAY_BEACON_MS)
+// Upstream polls wait this long after joining the group, an existing gateway is heard by then
+#define RELAY_LISTEN_MS (RELAY_BEACON_MS + 1000)
+#define RELAY_ELECTION_SPREAD_MS 5000
+
+enum RelayRole
+{
+  RELAY_ROLE_NONE,     // No gateway heard, fetching upstream
+  RELAY_ROLE_FOLLOWER, // Getting palettes from a gateway
+  RELAY_ROLE_GATEWAY
+};
+
+class PaletteRelay
+{
+public:
+  PaletteRelay();
+  // id must be unique on the LAN (e.g. from the MAC), lamps with the same site share palettes
+  void begin(uint32_t id, uint32_t site, bool mayLead);
+  // Call once per frame. Returns true when a new payload from the gateway is
+  // available in payload() / payloadLength().
+  bool poll();
+  // Gateway only: keep buf as the payload carried by beacons and multicast it now
+  void publish(const uint8_t *buf, size_t len);
+  // False while a gateway provides palettes or we're still listening for one
+  bool upstreamAllowed() const;
+  RelayRole role() const { return _role; }
+  const uint8_t *payload() const { return _payload; }
+  int payloadLength() const { return _payloadLen; }
+
+private:
+  void join();
+  void receive(unsigned long now, bool &updated);
+  void send();
+
+  WiFiUDP _udp;
+  bool _enabled;
+  bool _joined;
+  bool _mayLead;
+  RelayRole _role;
+  uint32_t _id;
+  uint32_t _site;
+  unsigned long _joinedAt;
+  unsigned long _heardAt;
+  unsigned long _sentAt;
+  uint8_t _packet[RELAY_HEADER_SIZE + PALETTE_PAYLOAD_MAX];
+  uint8_t _payload[PALETTE_PAYLOAD_MAX];
+  int _payloadLen;
+};
+
+#endif
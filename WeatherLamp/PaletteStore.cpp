@@ -0,0 +1,78 @@
+#include "PaletteStore.h"
+#include "PaletteFormat.h"
+#include <LittleFS.h>
+
+static uint32_t payloadCrc(const uint8_t *buf, size_t len)
+{
+  return readU32(buf + len - PALETTE_CRC_SIZE);
+}
+
+PaletteStore::PaletteStore() : _mounted(false), _storedCrc(0), _storedLen(0)
+{
+}
+
+bool PaletteStore::begin()
+{
+  _mounted = LittleFS.begin();
+  if (!_mounted)
+  {
+    Serial.println(F("LittleFS mount failed, palette won't be persisted"));
+  }
+  return _mounted;
+}
+
+int PaletteStore::load(uint8_t *buf, size_t bufSize)
+{
+  if (!_mounted)
+  {
+    return -1;
+  }
+  File f = LittleFS.open(PALETTE_STORE_PATH, "r");
+  if (!f)
+  {
+    return -1;
+  }
+  size_t len = f.size();
+  if (len < PALETTE_HEADER_SIZE + PALETTE_CRC_SIZE || len > bufSize)
+  {
+    f.close();
+    return -1;
+  }
+  len = f.read(buf, len);
+  f.close();
+  PaletteHeader header;
+  if (parsePalettePayload(buf, len, header) != PALETTE_OK)
+  {
+    return -1;
+  }
+  _storedCrc = payloadCrc(buf, len);
+  _storedLen = len;
+  return len;
+}
+
+bool PaletteStore::save(const uint8_t *buf, size_t len)
+{
+  if (!_mounted || len < PALETTE_CRC_SIZE)
+  {
+    return false;
+  }
+  uint32_t crc = payloadCrc(buf, len);
+  if (len == _storedLen && crc == _storedCrc)
+  {
+    return true; // Already stored
+  }
+  File f = LittleFS.open(PALETTE_STORE_PATH, "w");
+  if (!f)
+  {
+    return false;
+  }
+  bool ok = f.write(buf, len) == len;
+  f.close();
+  if (ok)
+  {
+    _storedCrc = crc;
+    _storedLen = len;
+    Serial.println(F("Stored palette to flash"));
+  }
+  return ok;
+}
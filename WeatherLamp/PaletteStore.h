@@ -0,0 +1,35 @@
+/**************************************************************************************
+   Last valid palette payload kept in LittleFS, so it can be shown right after boot
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   The raw payload is stored as is; it already carries its timestamps and CRC.
+   The file is only rewritten when the CRC of a new payload differs from the
+   stored one, so the same forecast arriving every poll doesn't wear the flash.
+
+ **************************************************************************************/
+
+#ifndef PALETTE_STORE_H
+#define PALETTE_STORE_H
+
+#include <Arduino.h>
+
+#define PALETTE_STORE_PATH "/palette.bin"
+
+class PaletteStore
+{
+public:
+  PaletteStore();
+  bool begin();
+  // Read the stored payload into buf, returns its length or -1 if there is none
+  int load(uint8_t *buf, size_t bufSize);
+  // Store a validated payload unless it's the one already stored
+  bool save(const uint8_t *buf, size_t len);
+
+private:
+  bool _mounted;
+  uint32_t _storedCrc;
+  size_t _storedLen;
+};
+
+#endif
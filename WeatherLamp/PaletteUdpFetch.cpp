@@ -0,0 +1,162 @@
+#include "PaletteUdpFetch.h"
+
+PaletteUdpFetch::PaletteUdpFetch()
+    : _state(FETCH_IDLE), _server(UDP_FETCH_DEFAULT_PORT), _token(0), _attempts(0), _startedAt(0), _sentAt(0),
+      _startUs(0), _sentUs(0), _connectUs(0), _transferUs(0), _bytesReceived(0), _status(0), _maxAge(0), _bodyLen(0),
+      _haveCrc(0)
+{
+}
+
+bool PaletteUdpFetch::start()
+{
+  if (_state != FETCH_IDLE || !_server.isSet())
+  {
+    return false;
+  }
+  if (!_udp.begin(0)) // Fresh local port, answers to an earlier fetch can't reach this one
+  {
+    return false;
+  }
+  _status = 0;
+  _maxAge = 0;
+  _bodyLen = 0;
+  _attempts = 0;
+  _token = ESP.random();
+  _startedAt = millis();
+  _startUs = micros();
+  _sentUs = 0;
+  _connectUs = 0;
+  _transferUs = 0;
+  _state = FETCH_RESOLVE;
+
+  if (!_server.resolve())
+  {
+    fail(F("DNS lookup"));
+  }
+  return _state != FETCH_IDLE;
+}
+
+void PaletteUdpFetch::accept()
+{
+  if (_bodyLen >= PALETTE_CRC_SIZE)
+  {
+    _haveCrc = readU32(_body + _bodyLen - PALETTE_CRC_SIZE);
+  }
+}
+
+FetchResult PaletteUdpFetch::poll(unsigned long budgetUs)
+{
+  if (_state == FETCH_IDLE)
+  {
+    return FETCH_PENDING;
+  }
+  unsigned long now = millis();
+  if (now - _startedAt > FETCH_TIMEOUT_MS)
+  {
+    fail(F("timeout"));
+    return FETCH_FAILED;
+  }
+
+  if (_state == FETCH_RESOLVE)
+  {
+    if (!_server.resolved())
+    {
+      return FETCH_PENDING;
+    }
+    if (!_server.found())
+    {
+      fail(F("DNS lookup"));
+      return FETCH_FAILED;
+    }
+    _connectUs = micros() - _startUs;
+    _state = FETCH_SEND;
+  }
+
+  if (_state == FETCH_SEND || (_state == FETCH_RECV_BODY && now - _sentAt >= UDP_FETCH_RESEND_MS))
+  {
+    if (_attempts == UDP_FETCH_ATTEMPTS)
+    {
+      _server.forget(); // Server may have moved, resolve again next time
+      fail(F("no response"));
+      return FETCH_FAILED;
+    }
+    sendRequest();
+    return _state == FETCH_IDLE ? FETCH_FAILED : FETCH_PENDING;
+  }
+
+  // Datagrams are small, one parsePacket() per poll fits any budget
+  int size = _udp.parsePacket();
+  if (size <= 0)
+  {
+    return FETCH_PENDING;
+  }
+  int len = _udp.read(_packet, sizeof(_packet));
+  _bytesReceived += size;
+  if (len < UDP_FETCH_HEADER_SIZE || _packet[0] != 'W' || _packet[1] != 'P' ||
+      _packet[2] != UDP_FETCH_VERSION || readU32(_packet + 4) != _token || _udp.remoteIP() != _server.addr())
+  {
+    return FETCH_PENDING; // Stray or late answer to an earlier attempt
+  }
+  _transferUs = micros() - _sentUs;
+  _maxAge = readU32(_packet + 8);
+  _state = FETCH_IDLE;
+  switch (_packet[3])
+  {
+  case UDP_CODE_CONTENT:
+    _status = 200;
+    _bodyLen = len - UDP_FETCH_HEADER_SIZE;
+    memcpy(_body, _packet + UDP_FETCH_HEADER_SIZE, _bodyLen);
+    return FETCH_UPDATED;
+  case UDP_CODE_NOT_MODIFIED:
+    _status = 304;
+    return FETCH_NOT_MODIFIED;
+  case UDP_CODE_NOT_FOUND:
+    _status = 404;
+    break;
+  case UDP_CODE_BAD_REQUEST:
+    _status = 400;
+    break;
+  case UDP_CODE_UNAVAILABLE:
+    _status = 503;
+    break;
+  default:
+    _status = -1;
+    break;
+  }
+  fail(F("unexpected response"));
+  return FETCH_FAILED;
+}
+
+void PaletteUdpFetch::sendRequest()
+{
+  size_t pathLen = strlen(_server.path());
+  _packet[0] = 'W';
+  _packet[1] = 'Q';
+  _packet[2] = UDP_FETCH_VERSION;
+  _packet[3] = 0;
+  writeU32(_packet + 4, _token);
+  writeU32(_packet + 8, _haveCrc);
+  memcpy(_packet + UDP_FETCH_HEADER_SIZE, _server.path(), pathLen);
+  // FETCH_PATH_MAX is well below the padded size, so the path always fits
+  memset(_packet + UDP_FETCH_HEADER_SIZE + pathLen, 0, UDP_FETCH_REQUEST_SIZE - UDP_FETCH_HEADER_SIZE - pathLen);
+  if (!_udp.beginPacket(_server.addr(), _server.port()) || _udp.write(_packet, UDP_FETCH_REQUEST_SIZE) == 0 ||
+      !_udp.endPacket())
+  {
+    fail(F("send"));
+    return;
+  }
+  _attempts++;
+  _sentAt = millis();
+  if (_sentUs == 0)
+  {
+    _sentUs = micros();
+  }
+  _state = FETCH_RECV_BODY;
+}
+
+void PaletteUdpFetch::fail(const __FlashStringHelper *reason)
+{
+  Serial.print(F("Palette fetch failed: "));
+  Serial.println(reason);
+  _state = FETCH_IDLE;
+}
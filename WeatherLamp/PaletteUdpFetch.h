@@ -0,0 +1,118 @@
+/**************************************************************************************
+   Palette fetch over UDP, one request and one response datagram
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Alternative to the HTTP transport for lossy or slow links: a poll is a
+   single round trip with no TCP handshake or headers. The request carries the
+   CRC of the palette we already have, so an unchanged palette costs a 12 byte
+   answer, like HTTP's 304. Lost datagrams are resent with the same token.
+   Server: py/paletteudpserver.py, keep the two in sync.
+
+   Request, little-endian:
+
+   offset  size  field
+        0     2  magic "WQ"
+        2     1  version (UDP_FETCH_VERSION)
+        3     1  flags, reserved (0)
+        4     4  token, echoed in the response
+        8     4  CRC field of the payload we have, 0 if none
+       12     n  path, e.g. "/weatherlamp.bin?lat=60.1&lon=24.9", NUL padded
+
+   Requests are padded to UDP_FETCH_REQUEST_SIZE, the size of the largest
+   response, and the server answers shorter ones with UDP_CODE_BAD_REQUEST and
+   no payload. A spoofed source address then gets no more bytes than were sent.
+
+   Response:
+
+        0     2  magic "WP"
+        2     1  version
+        3     1  code (UdpFetchCode)
+        4     4  token of the request
+        8     4  max-age in seconds, 0 if the server doesn't say
+       12     n  palette payload (see PaletteFormat.h), only with UDP_CODE_CONTENT
+
+   The interface is the same as PaletteFetch's, so the sketch can use either.
+   status() maps the codes to their HTTP equivalents.
+
+ **************************************************************************************/
+
+#ifndef PALETTE_UDP_FETCH_H
+#define PALETTE_UDP_FETCH_H
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "FetchHost.h"
+#include "PaletteFetch.h"
+
+#define PALETTE_TRANSPORT_HTTP 0 // PaletteFetch
+#define PALETTE_TRANSPORT_UDP 1  // PaletteUdpFetch
+
+#ifndef PALETTE_TRANSPORT
+#define PALETTE_TRANSPORT PALETTE_TRANSPORT_HTTP
+#endif
+
+#define UDP_FETCH_VERSION 1
+#define UDP_FETCH_HEADER_SIZE 12
+#define UDP_FETCH_REQUEST_SIZE (UDP_FETCH_HEADER_SIZE + FETCH_BODY_MAX) // Header and largest payload
+#define UDP_FETCH_DEFAULT_PORT 5688
+#define UDP_FETCH_RESEND_MS 700 // Resend the request if nothing came back in this time
+#define UDP_FETCH_ATTEMPTS 4    // Gives up after about FETCH_TIMEOUT_MS
+
+enum UdpFetchCode
+{
+  UDP_CODE_CONTENT = 0,      // 200
+  UDP_CODE_NOT_MODIFIED = 1, // 304
+  UDP_CODE_NOT_FOUND = 2,    // 404
+  UDP_CODE_BAD_REQUEST = 3,  // 400
+  UDP_CODE_UNAVAILABLE = 4   // 503, retry after max-age
+};
+
+class PaletteUdpFetch
+{
+public:
+  PaletteUdpFetch();
+  // Parse a udp://host[:port]/path URL, returns false if it isn't one
+  bool setUrl(const char *url) { return _server.setUrl(url, "udp://"); }
+  bool start();
+  FetchResult poll(unsigned long budgetUs);
+  bool idle() const { return _state == FETCH_IDLE; }
+  FetchState state() const { return _state; }
+  int status() const { return _status; }
+  const uint8_t *body() const { return _body; }
+  int bodyLength() const { return _bodyLen; }
+  // Resolve time, and request sent to response received (including resends)
+  unsigned long connectUs() const { return _connectUs; }
+  unsigned long transferUs() const { return _transferUs; }
+  bool reused() const { return false; }
+  unsigned long maxAge() const { return _status == 503 ? 0 : _maxAge; }
+  unsigned long retryAfter() const { return _status == 503 ? _maxAge : 0; }
+  unsigned long bytesReceived() const { return _bytesReceived; }
+  void accept();
+
+private:
+  void sendRequest();
+  void fail(const __FlashStringHelper *reason);
+
+  WiFiUDP _udp;
+  FetchState _state;
+  FetchHost _server;
+  uint32_t _token;
+  uint8_t _attempts;
+  unsigned long _startedAt;
+  unsigned long _sentAt;
+  unsigned long _startUs;
+  unsigned long _sentUs;
+  unsigned long _connectUs;
+  unsigned long _transferUs;
+  unsigned long _bytesReceived;
+
+  int _status;
+  unsigned long _maxAge;
+  uint8_t _packet[UDP_FETCH_HEADER_SIZE + FETCH_BODY_MAX];
+  uint8_t _body[FETCH_BODY_MAX];
+  int _bodyLen;
+  uint32_t _haveCrc; // CRC field of the last accepted payload
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include "PollScheduler.h"
+
+PollScheduler::PollScheduler(unsigned long intervalMs, unsigned long maxBackoffMs)
+    : _interval(intervalMs), _maxBackoff(maxBackoffMs), _next(0), _rng(1), _failures(0)
+{
+}
+
+void PollScheduler::begin(uint32_t seed, unsigned long firstSpreadMs)
+{
+  _rng = seed ? seed : 1; // xorshift state must not be 0
+  _failures = 0;
+  _next = millis() + (firstSpreadMs ? random() % firstSpreadMs : 0);
+}
+
+/**
+   xorshift32, good enough for spreading polls and cheap enough to not matter
+*/
+uint32_t PollScheduler::random()
+{
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
+
+/**
+   Schedule the next poll delayMs from now, +-10 % jitter
+*/
+void PollScheduler::scheduleIn(unsigned long delayMs)
+{
+  unsigned long spread = delayMs / 5;
+  if (spread > 0)
+  {
+    delayMs = delayMs - spread / 2 + random() % spread;
+  }
+  _next = millis() + delayMs;
+}
+
+/**
+   Server hint in ms, capped in seconds first: max-age=31536000 is a common
+   header and would wrap around in 32-bit milliseconds
+*/
+unsigned long PollScheduler::hintMs(unsigned long hintS)
+{
+  return (hintS < POLL_MAX_HINT_S ? hintS : POLL_MAX_HINT_S) * 1000;
+}
+
+void PollScheduler::success(unsigned long maxAgeS)
+{
+  _failures = 0;
+  unsigned long delayMs = hintMs(maxAgeS);
+  scheduleIn(delayMs > _interval ? delayMs : _interval);
+}
+
+void PollScheduler::failure(unsigned long retryAfterS)
+{
+  if (_failures < 31)
+  {
+    _failures++;
+  }
+  // interval * 2^failures, without overflowing
+  unsigned long backoff = _interval;
+  for (uint8_t i = 0; i < _failures && backoff < _maxBackoff; i++)
+  {
+    backoff *= 2;
+  }
+  if (backoff > _maxBackoff)
+  {
+    backoff = _maxBackoff;
+  }
+  unsigned long retryAfterMs = hintMs(retryAfterS);
+  scheduleIn(retryAfterMs > backoff ? retryAfterMs : backoff);
+}
@@ -0,0 +1,48 @@
+/**************************************************************************************
+   Palette poll scheduling with per-device jitter and exponential backoff
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Lamps powered up together would otherwise poll in lockstep, and keep
+   polling a server that is down at the full rate. Every delay is jittered
+   with a PRNG seeded from the MAC address, errors back off exponentially,
+   and server hints (Cache-Control: max-age, Retry-After) set the minimum
+   time until the next poll.
+
+ **************************************************************************************/
+
+#ifndef POLL_SCHEDULER_H
+#define POLL_SCHEDULER_H
+
+#include <Arduino.h>
+
+// Server hints longer than this are capped, so a bad header can't stall a lamp for days
+#define POLL_MAX_HINT_S (6 * 60 * 60UL)
+
+class PollScheduler
+{
+public:
+  PollScheduler(unsigned long intervalMs, unsigned long maxBackoffMs);
+  // Seed the jitter and schedule the first poll within the first firstSpreadMs
+  void begin(uint32_t seed, unsigned long firstSpreadMs);
+  bool due() const { return (long)(millis() - _next) >= 0; }
+  // maxAgeS is the server's max-age in seconds, 0 if it didn't send one
+  void success(unsigned long maxAgeS);
+  // retryAfterS is the server's Retry-After in seconds, 0 if it didn't send one
+  void failure(unsigned long retryAfterS);
+  uint8_t failures() const { return _failures; }
+  unsigned long nextIn() const { return due() ? 0 : _next - millis(); }
+
+private:
+  uint32_t random();
+  void scheduleIn(unsigned long delayMs);
+  static unsigned long hintMs(unsigned long hintS);
+
+  unsigned long _interval;
+  unsigned long _maxBackoff;
+  unsigned long _next;
+  uint32_t _rng;
+  uint8_t _failures;
+};
+
+#endif
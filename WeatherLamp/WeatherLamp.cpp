@@ -9,7 +9,9 @@
 
    PubSubClient (version >= 2.6.0 by Nick O'Leary)
    ArduinoJson (version > 5.13 < 6.0 by Benoit Blanchon)
-   WiFiManager (version >= 0.14.0 by tzapu)
+   WiFiManager (version >= 2.0.0 by tzapu, for the non-blocking config portal)
+   ESPAsyncTCP (by me-no-dev)
+   NeoPixelBus (by Makuna, only for LED_OUTPUT_UART1 and LED_OUTPUT_DMA)
 
  **************************************************************************************/
 
@@ -20,65 +22,192 @@
 #include <ESP8266WiFi.h>
 #include <DNSServer.h> // Local DNS Server used for redirecting all requests to the configuration portal
 #include <ESP8266mDNS.h>
-#include <ESP8266WebServer.h> // Local WebServer used to serve the configuration portal
+#include <ESP8266WebServer.h> // Local WebServer used to serve the configuration portal and /metrics
 #include <WiFiManager.h>      // https://github.com/tzapu/WiFiManager WiFi Configuration Magic
-#include <ESP8266HTTPClient.h>
+#include "PaletteFetch.h"
+#include "PaletteUdpFetch.h"
+#include "FrameTimer.h"
+#include "PaletteLut.h"
+#include "PaletteFormat.h"
+#include "PaletteStore.h"
+#include "Metrics.h"
+#include "LedOutput.h"
+#include "Effects.h"
+#include "HeapStats.h"
+#include "PaletteRelay.h"
+#include "PollScheduler.h"
+#include <time.h>
 #ifndef FastLED
 #include <FastLED.h>
 #endif
 
+// Defaults for settings.h files copied from an older settings-example.h
+#ifndef MQTT_PALETTE_TOPIC
+#define MQTT_PALETTE_TOPIC "weatherlamp/palette/%s_%s"
+#endif
+#ifndef MQTT_RECONNECT_MS
+#define MQTT_RECONNECT_MS 5000
+#endif
+#ifndef MQTT_PALETTE_STALE_MS
+#define MQTT_PALETTE_STALE_MS (45 * 60 * 1000UL)
+#endif
+#ifndef NTP_SERVER
+#define NTP_SERVER "pool.ntp.org"
+#endif
+
 // I2C settings
 // #define SDA     D2
 // #define SCL     D1
 
 // define your default values here, if there are different values in config.json, they are overwritten.
-char http_url[250] = "http://rista.net/?weatherlamp=true";
+char http_url[250] = "http://porr.rista.fi/weatherlamp.bin";
 char latitude[16] = "60.123";
 char longitude[16] = "24.945";
 
 // Move to settings, perhaps?
 CRGBPalette16 currentPalette;
+CRGBPalette16 targetPalette; // currentPalette fades towards this a little every frame
+PaletteLut paletteLut; // currentPalette expanded with brightness and blending applied
 TBlendType currentBlending;
-uint8_t currentMode = '0';
-uint8_t activeEffect = '0';
+// Effects selectable with the 'e' MQTT command, by position in this list.
+// Leave out the ones you don't need to keep them out of the firmware.
+typedef EffectRegistry<PaletteEffect<NUM_LEDS>, SolidEffect<NUM_LEDS> > Effects;
+uint8_t activeEffect = 0;
 uint8_t brightness = BRIGHTNESS;
-static uint8_t startIndex = 0;
 uint8_t colorIndex = 0;
+// Set whenever palette or colour changes, so the next frame gets rendered and shown
+bool ledsDirty = true;
+// False until a forecast palette has been loaded or fetched
+bool havePalette = false;
+unsigned long lastShow = 0;
+bool showPending = false; // leds[] has a frame the output hasn't taken yet
 
 uint8_t r = 0;
 uint8_t g = 0;
 uint8_t b = 0;
 
+// Presets for the 'p' MQTT command. FastLED keeps the palettes in flash, and so
+// does this table, only the selected one is copied into targetPalette.
+struct PresetPalette
+{
+  const TProgmemRGBPalette16 *palette;
+  const char *name;
+};
+static const char PRESET_RAINBOW[] PROGMEM = "RainbowColors_p";
+static const char PRESET_RAINBOW_STRIPE[] PROGMEM = "RainbowStripeColors_p";
+static const char PRESET_OCEAN[] PROGMEM = "OceanColors_p";
+static const char PRESET_CLOUD[] PROGMEM = "CloudColors_p";
+static const char PRESET_LAVA[] PROGMEM = "LavaColors_p";
+static const char PRESET_FOREST[] PROGMEM = "ForestColors_p";
+static const char PRESET_PARTY[] PROGMEM = "PartyColors_p";
+static const PresetPalette PRESET_PALETTES[] PROGMEM = {
+    {&RainbowColors_p, PRESET_RAINBOW},
+    {&RainbowStripeColors_p, PRESET_RAINBOW_STRIPE},
+    {&OceanColors_p, PRESET_OCEAN},
+    {&CloudColors_p, PRESET_CLOUD},
+    {&LavaColors_p, PRESET_LAVA},
+    {&ForestColors_p, PRESET_FOREST},
+    {&PartyColors_p, PRESET_PARTY}};
+#define PRESET_PALETTE_COUNT (sizeof(PRESET_PALETTES) / sizeof(PRESET_PALETTES[0]))
+
+// Palette is polled this often over HTTP, unless MQTT delivers it or the server asks for less
+#define POLL_INTERVAL_MS 10000
+#define POLL_MAX_BACKOFF_MS (15 * 60 * 1000UL)
+// First poll after boot is spread over this, so lamps powered up together don't poll in lockstep
+#define POLL_FIRST_SPREAD_MS 3000
+// Failed MQTT connects are retried after MQTT_RECONNECT_MS, doubling up to this
+#define MQTT_MAX_BACKOFF_MS (10 * 60 * 1000UL)
+
 // Define and set up all variables / objects
 WiFiClient wifiClient;
+PubSubClient mqttClient(wifiClient);
 WiFiManager wifiManager;
-String mac_str;
+// Portal runs from loop(), so the parameters must outlive setup()
+WiFiManagerParameter custom_http_url("server", "Data URL", http_url, 250);
+WiFiManagerParameter custom_latitude("port", "Latitude ° (60.172)", "60.172", 16);
+WiFiManagerParameter custom_longitude("user", "Longitude ° (24.945)", longitude, 16);
 byte mac[6];
 char macAddr[13];
-unsigned long lastPing = 0;
+char ap_name[30];
+PollScheduler pollScheduler(POLL_INTERVAL_MS, POLL_MAX_BACKOFF_MS);
+unsigned long lastMqttConnect = 0;
+unsigned long mqttRetryMs = MQTT_RECONNECT_MS;
+unsigned long lastMqttPalette = 0; // 0 = no palette received over MQTT yet
+char mqttPaletteTopic[64];
+#if PALETTE_TRANSPORT == PALETTE_TRANSPORT_UDP
+PaletteUdpFetch paletteFetch;
+#else
+PaletteFetch paletteFetch;
+#endif
+PaletteStore paletteStore;
+FrameTimer frameTimer(1000000UL / UPDATES_PER_SECOND);
+LedOutput<NUM_LEDS> ledOutput;
+Metrics metrics;
+PaletteRelay paletteRelay;
+// Prometheus scrape target, on its own port so it doesn't clash with the config portal
+ESP8266WebServer metricsServer(METRICS_PORT);
+// Last valid palette payload, which may cover more time than the 16 slots shown.
+// currentPalette shows the window of it starting at slot paletteWindow.
+uint8_t paletteBundle[PALETTE_PAYLOAD_MAX];
+PaletteHeader paletteHeader;
+int paletteWindow = -1; // -1 = no bundle yet
+#define PALETTE_SLOTS 16
+// Colour channel steps per frame when fading to a new palette, a full fade takes at most 255 frames
+#define PALETTE_BLEND_CHANGES 48
+// Anything before this means SNTP hasn't set the clock yet
+#define TIME_VALID_AFTER 1600000000
+// Time loop() may spend on the palette fetch per frame
+#define FETCH_SLICE_US 2000
+// Unchanged frames are still re-sent this often, in case a strip glitched or was re-plugged
+#define LED_REFRESH_MS 1000
+// Open the config portal if WiFi has been down for this long
+#define WIFI_PORTAL_DELAY_MS 60000
 
 /* Sensor variables */
 
 void requestData();
 void requestData2();
-void runLedEffect();
+void pollData();
+void showStoredPalette();
+void saveConfigCallback();
+void setPaletteUrl();
+void tickWifi();
+bool mqttEnabled();
+void mqttConnect();
+void mqttCallback(char *topic, byte *payload, unsigned int length);
+bool mqttPaletteFresh();
+void switchMode(byte *payload, unsigned int length);
+void setSolidColor(byte *payload, unsigned int length);
+void setActiveEffect(byte *payload, unsigned int length);
+void handleSerial();
+void handleMetrics();
+bool decodePalette(const uint8_t *buf, int len);
+void usePalette(const uint8_t *buf, int len, bool fromRelay);
+bool paletteExpired(const PaletteHeader &header);
+void updatePaletteWindow();
+bool runLedEffect();
 
 void setup()
 {
-  WiFiManagerParameter custom_http_url("server", "Data URL", http_url, 250);
-  WiFiManagerParameter custom_latitude("port", "Latitude ° (60.172)", "60.172", 16);
-  WiFiManagerParameter custom_longitude("user", "Longitude ° (24.945)", longitude, 16);
   // Add all your parameters here
   wifiManager.addParameter(&custom_http_url);
   wifiManager.addParameter(&custom_latitude);
   wifiManager.addParameter(&custom_longitude);
   // wifiManager.resetSettings();
-  mac_str = WiFi.macAddress();
   WiFi.macAddress(mac);
   // Wire.begin(SDA, SCL);
   Serial.begin(115200);
   Serial.println();
   Serial.println();
+  Serial.println(F("Init FastLED"));
+  ledOutput.begin(leds);
+
+  FastLED.setBrightness(BRIGHTNESS);
+
+  currentPalette = RainbowColors_p;
+  targetPalette = currentPalette;
+  currentBlending = LINEARBLEND;
+  showStoredPalette();
   //read updated parameters
   strcpy(http_url, custom_http_url.getValue());
   strcpy(latitude, custom_latitude.getValue());
@@ -89,87 +218,485 @@ void setup()
   // Serial.println(mqtt_password);
   // Serial.println(room_token);
   sprintf(macAddr, "%2X%2X%2X%2X%2X%2X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-  char ap_name[30];
+  uint32_t lampId = (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | mac[4] << 8 | mac[5];
+  pollScheduler.begin(lampId, POLL_FIRST_SPREAD_MS);
   sprintf(ap_name, "%s_%s", AP_NAME, macAddr);
-  Serial.print("AP name would be: ");
+  Serial.print(F("AP name would be: "));
   Serial.println(ap_name);
-  wifiManager.autoConnect(ap_name);
-  Serial.println("Init FastLED");
-  FastLED.addLeds<LED_TYPE, LED_PIN, COLOR_ORDER>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
-  // FastLED.addLeds<LED_TYPE, LED_PIN, CLK_PIN, COLOR_ORDER>(leds, NUM_LEDS).setCorrection( TypicalLEDStrip );
+  // autoConnect() would wait for the connection result, so connect in the background
+  // instead and let loop() run the portal only when it's needed
+  wifiManager.setConfigPortalBlocking(false);
+  wifiManager.setSaveConfigCallback(saveConfigCallback);
+  if (wifiManager.getWiFiIsSaved())
+  {
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();
+  }
+  else
+  {
+    wifiManager.startConfigPortal(ap_name);
+  }
+  setPaletteUrl();
 
-  FastLED.setBrightness(BRIGHTNESS);
+  // SNTP runs in the background once WiFi is up, the bundle window needs the time
+  configTime(0, 0, NTP_SERVER);
 
-  currentPalette = RainbowColors_p;
-  currentBlending = LINEARBLEND;
+  snprintf(mqttPaletteTopic, sizeof(mqttPaletteTopic), MQTT_PALETTE_TOPIC, latitude, longitude);
+  if (RELAY_MODE != RELAY_OFF)
+  {
+    // Lamps share palettes only with lamps configured for the same location
+    char site[sizeof(latitude) + sizeof(longitude)];
+    int siteLen = snprintf(site, sizeof(site), "%s,%s", latitude, longitude);
+    paletteRelay.begin(lampId, paletteCrc32((const uint8_t *)site, siteLen), RELAY_MODE == RELAY_AUTO);
+  }
+  mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
+  mqttClient.setCallback(mqttCallback);
+
+  metricsServer.on("/metrics", handleMetrics);
+  metricsServer.begin();
+
+  // Everything allocated from here on is a leak or fragmentation risk
+  printRamReport(Serial);
 }
 
-void requestData()
+/**
+   Show the last palette we got before power-off or reset, before WiFi is up
+*/
+void showStoredPalette()
 {
+  uint8_t payload[PALETTE_PAYLOAD_MAX];
+  paletteStore.begin();
+  int len = paletteStore.load(payload, sizeof(payload));
+  if (len > 0 && decodePalette(payload, len))
+  {
+    Serial.println(F("Showing stored palette"));
+    havePalette = true;
+    currentPalette = targetPalette; // No fade in at boot
+  }
+  runLedEffect();
+  ledOutput.show();
+}
+
+/**
+   Run the non-blocking config portal. ESP8266 reconnects to the saved AP by itself,
+   the portal is only opened if that hasn't worked for WIFI_PORTAL_DELAY_MS.
+*/
+void tickWifi()
+{
+  static unsigned long wifiDownSince = 0;
+  wifiManager.process();
   if (WiFi.status() == WL_CONNECTED)
   {
-    HTTPClient http;
-    String http_url = "http://porr.rista.fi/weatherlamp.bin";
-    String serverPath = http_url + "?temperature=24.37";
+    wifiDownSince = 0;
+    if (wifiManager.getConfigPortalActive())
+    {
+      wifiManager.stopConfigPortal();
+    }
+  }
+  else if (wifiDownSince == 0)
+  {
+    wifiDownSince = millis() | 1; // Never 0, that means "up"
+  }
+  else if (!wifiManager.getConfigPortalActive() && millis() - wifiDownSince > WIFI_PORTAL_DELAY_MS)
+  {
+    Serial.println(F("WiFi not connecting, starting config portal"));
+    wifiManager.startConfigPortal(ap_name);
+  }
+}
 
-    // Your Domain name with URL path or IP address with path
-    http.begin(serverPath.c_str());
+/**
+   Called by WiFiManager when the config portal has saved new settings
+*/
+void saveConfigCallback()
+{
+  strlcpy(http_url, custom_http_url.getValue(), sizeof(http_url));
+  strlcpy(latitude, custom_latitude.getValue(), sizeof(latitude));
+  strlcpy(longitude, custom_longitude.getValue(), sizeof(longitude));
+  snprintf(mqttPaletteTopic, sizeof(mqttPaletteTopic), MQTT_PALETTE_TOPIC, latitude, longitude);
+  setPaletteUrl();
+}
 
-    // Send HTTP GET request
-    int httpResponseCode = http.GET();
+/**
+   Palette URL is the configured data URL with the lamp's location appended,
+   the palette server picks the forecast by lat and lon.
+*/
+void setPaletteUrl()
+{
+#if PALETTE_TRANSPORT == PALETTE_TRANSPORT_UDP
+  const char *base = PALETTE_UDP_URL;
+#else
+  const char *base = http_url;
+#endif
+  char url[sizeof(http_url) + sizeof(latitude) + sizeof(longitude) + 10];
+  snprintf(url, sizeof(url), "%s%clat=%s&lon=%s", base, strchr(base, '?') ? '&' : '?', latitude, longitude);
+  Serial.print(F("Palette URL: "));
+  Serial.println(url);
+  if (!paletteFetch.setUrl(url))
+  {
+    Serial.println(F("Palette URL is not valid or too long"));
+  }
+}
+
+/**
+   MQTT is optional, a lamp built with the example settings only polls.
+*/
+bool mqttEnabled()
+{
+  return MQTT_SERVER[0] != '\0' && strcmp(MQTT_SERVER, "mqtt.example.org") != 0;
+}
+
+/**
+   (Re)connect to the MQTT broker. PubSubClient's connect blocks until the broker
+   answers or times out, stalling the LEDs, so failures back off exponentially
+   from MQTT_RECONNECT_MS to MQTT_MAX_BACKOFF_MS.
+*/
+void mqttConnect()
+{
+  unsigned long now = millis();
+  if (WiFi.status() != WL_CONNECTED || (lastMqttConnect != 0 && now - lastMqttConnect < mqttRetryMs))
+  {
+    return;
+  }
+  lastMqttConnect = now;
+  char clientId[30];
+  snprintf(clientId, sizeof(clientId), "%s_%s", AP_NAME, macAddr);
+  if (!mqttClient.connect(clientId, MQTT_USER, MQTT_PASSWORD))
+  {
+    mqttRetryMs = mqttRetryMs * 2 < MQTT_MAX_BACKOFF_MS ? mqttRetryMs * 2 : MQTT_MAX_BACKOFF_MS;
+    Serial.print(F("MQTT connect failed, state: "));
+    Serial.print(mqttClient.state());
+    Serial.print(F(", retrying in "));
+    Serial.print(mqttRetryMs / 1000);
+    Serial.println(F(" s"));
+    return;
+  }
+  mqttRetryMs = MQTT_RECONNECT_MS;
+  Serial.print(F("MQTT connected, subscribing to "));
+  Serial.println(mqttPaletteTopic);
+  // Palette messages are retained, so the current one arrives right after subscribing
+  mqttClient.subscribe(mqttPaletteTopic);
+  mqttClient.subscribe(MQTT_SUB_TOPIC);
+  mqttClient.publish(MQTT_PUB_TOPIC, macAddr);
+}
 
-    if (httpResponseCode > 0)
+/**
+   Palette messages carry a binary payload (see PaletteFormat.h). Control messages
+   are "<command>,<args>": 'p' switches palette, 'c' sets solid colour (raw R, G, B
+   bytes), 'e' sets active effect.
+*/
+void mqttCallback(char *topic, byte *payload, unsigned int length)
+{
+  if (strcmp(topic, mqttPaletteTopic) == 0)
+  {
+    if (decodePalette(payload, length))
     {
-      Serial.print("HTTP Response code: ");
-      Serial.println(httpResponseCode);
-      Serial.print("NUM_LEDS: ");
-      Serial.println(NUM_LEDS);
-
-      String payload = http.getString();
-      Serial.println(payload);
-      currentPalette = CRGBPalette16();
-
-      for (int i = 0; i < 16; i++) {
-        uint8_t i1 = i*3;
-        uint8_t i2 = i*3 + 1;
-        uint8_t i3 = i*3 + 2;
-        uint8_t r = (uint8_t)payload[i1];
-        uint8_t g = (uint8_t)payload[i2];
-        uint8_t b = (uint8_t)payload[i3];
-        Serial.print(r);
-        Serial.print(",");
-        Serial.print(g);
-        Serial.print(",");
-        Serial.print(b);
-        Serial.println();
-        currentPalette[i] = CRGB(r, g, b);
-      }
+      Serial.println(F("Got palette over MQTT"));
+      usePalette(payload, length, false);
+      lastMqttPalette = millis() | 1; // Never 0, that means "none yet"
     }
-    else
+    return;
+  }
+  if (length < 3)
+  {
+    Serial.println(F("Too short MQTT message"));
+    return;
+  }
+  switch (payload[0])
+  {
+  case 'p':
+    switchMode(payload, length);
+    break;
+  case 'c':
+    if (length >= 5)
     {
-      Serial.print("Error code: ");
-      Serial.println(httpResponseCode);
+      setSolidColor(payload, length);
     }
-    // Free resources
-    http.end();
+    break;
+  case 'e':
+    setActiveEffect(payload, length);
+    break;
+  default:
+    Serial.print(F("Invalid MQTT command: "));
+    Serial.println((char)payload[0]);
+    break;
   }
-  else
+}
+
+/**
+   HTTP polling is only a fallback, used while MQTT hasn't delivered a palette recently
+*/
+bool mqttPaletteFresh()
+{
+  return mqttClient.connected() && lastMqttPalette != 0 && millis() - lastMqttPalette < MQTT_PALETTE_STALE_MS;
+}
+
+/**
+   Start fetching a new palette, pollData() does the actual work
+*/
+void requestData()
+{
+  if (!paletteFetch.start())
+  {
+    Serial.println(F("Palette fetch already in progress"));
+  }
+}
+
+/**
+   Advance the palette fetch by one time slice and commit the palette when it's done
+*/
+void pollData()
+{
+  FetchResult result = paletteFetch.poll(FETCH_SLICE_US);
+  if (result == FETCH_NOT_MODIFIED || result == FETCH_UPDATED)
+  {
+    Serial.print(paletteFetch.reused() ? F("Reused connection") : F("Connect us: "));
+    if (!paletteFetch.reused())
+    {
+      Serial.print(paletteFetch.connectUs());
+    }
+    Serial.print(F(", transfer us: "));
+    Serial.println(paletteFetch.transferUs());
+  }
+  unsigned long latencyUs = paletteFetch.connectUs() + paletteFetch.transferUs();
+  switch (result)
   {
-    Serial.println("WiFi Disconnected");
+  case FETCH_NOT_MODIFIED:
+    // Forecast hasn't changed since last fetch, keep the current palette
+    Serial.println(F("HTTP Response code: 304 (palette not modified)"));
+    metrics.fetchFinished(paletteFetch.status(), latencyUs, true);
+    pollScheduler.success(paletteFetch.maxAge());
+    break;
+  case FETCH_UPDATED:
+    Serial.print(F("HTTP Response code: "));
+    Serial.println(paletteFetch.status());
+    Serial.print(F("NUM_LEDS: "));
+    Serial.println(NUM_LEDS);
+    if (!decodePalette(paletteFetch.body(), paletteFetch.bodyLength()))
+    {
+      Serial.print(F("Invalid palette payload, length: "));
+      Serial.println(paletteFetch.bodyLength());
+      // The transfer worked but the lamp got nothing it can show
+      metrics.fetchFinished(paletteFetch.status(), latencyUs, false);
+      pollScheduler.failure(0);
+      break;
+    }
+    for (int i = 0; i < PALETTE_SLOTS; i++) {
+      Serial.print(targetPalette[i].r);
+      Serial.print(',');
+      Serial.print(targetPalette[i].g);
+      Serial.print(',');
+      Serial.print(targetPalette[i].b);
+      Serial.println();
+    }
+    usePalette(paletteFetch.body(), paletteFetch.bodyLength(), false);
+    metrics.fetchFinished(paletteFetch.status(), latencyUs, true);
+    pollScheduler.success(paletteFetch.maxAge());
+    // Next request will be conditional on this response
+    paletteFetch.accept();
+    break;
+  case FETCH_FAILED:
+    Serial.print(F("Error code: "));
+    Serial.println(paletteFetch.status());
+    metrics.fetchFinished(paletteFetch.status(), 0, false);
+    pollScheduler.failure(paletteFetch.retryAfter());
+    Serial.print(F("Next poll in ms: "));
+    Serial.println(pollScheduler.nextIn());
+    break;
+  default:
+    break;
   }
 }
 
+/**
+   Validate a versioned palette payload (see PaletteFormat.h), keep it as the
+   current bundle and show the window of it matching the current time.
+   Nothing changes if the payload is invalid.
+*/
+bool decodePalette(const uint8_t *buf, int len)
+{
+  PaletteHeader header;
+  PaletteError error = parsePalettePayload(buf, len, header);
+  if (error == PALETTE_OK && (header.slots < PALETTE_SLOTS || len > (int)sizeof(paletteBundle)))
+  {
+    error = PALETTE_BAD_LENGTH;
+  }
+  if (error != PALETTE_OK)
+  {
+    Serial.print(F("Rejected palette payload: "));
+    Serial.println(paletteErrorName(error));
+    return false;
+  }
+  if (paletteExpired(header))
+  {
+    Serial.println(F("Rejected palette payload: expired"));
+    return false;
+  }
+  memcpy(paletteBundle, buf, len);
+  paletteHeader = header;
+  paletteWindow = -1;
+  updatePaletteWindow();
+  return true;
+}
+
+/**
+   Show a palette decodePalette() accepted, keep it for the next boot and, when
+   this lamp is the relay gateway, share it with the others. A palette that came
+   from the relay is already theirs.
+*/
+void usePalette(const uint8_t *buf, int len, bool fromRelay)
+{
+  ledsDirty = true;
+  havePalette = true;
+  paletteStore.save(buf, len);
+  if (!fromRelay)
+  {
+    paletteRelay.publish(buf, len);
+  }
+}
+
+/**
+   True once the clock is set and the payload is past its validity. A stored,
+   relayed or retained payload may be days old.
+*/
+bool paletteExpired(const PaletteHeader &header)
+{
+  time_t now = time(NULL);
+  return now > TIME_VALID_AFTER && header.validMinutes > 0 &&
+         now >= (time_t)(header.baseTime + header.validMinutes * 60UL);
+}
+
+/**
+   Slide the 16 visible slots along the bundle as time passes. Until SNTP has set
+   the clock the bundle is shown from its first slot, and once the bundle runs out
+   its last 16 slots stay on until a new one arrives or it expires.
+*/
+void updatePaletteWindow()
+{
+  if (paletteHeader.slots < PALETTE_SLOTS)
+  {
+    return;
+  }
+  if (paletteExpired(paletteHeader))
+  {
+    // Old weather shown as the current forecast is worse than none, back to the connecting scroll
+    Serial.println(F("Palette expired"));
+    paletteHeader.slots = 0;
+    paletteWindow = -1;
+    havePalette = false;
+    targetPalette = RainbowColors_p;
+    ledsDirty = true;
+    return;
+  }
+  int first = 0;
+  time_t now = time(NULL);
+  if (now > TIME_VALID_AFTER && now > (time_t)paletteHeader.baseTime && paletteHeader.slotMinutes > 0)
+  {
+    unsigned long slot = (now - paletteHeader.baseTime) / (paletteHeader.slotMinutes * 60UL);
+    first = slot < paletteHeader.slots ? slot : paletteHeader.slots;
+  }
+  if (first > paletteHeader.slots - PALETTE_SLOTS)
+  {
+    first = paletteHeader.slots - PALETTE_SLOTS;
+  }
+  if (first == paletteWindow)
+  {
+    return;
+  }
+  paletteWindow = first;
+  const uint8_t *p = paletteBundle + paletteHeader.headerSize + first * 3;
+  for (int i = 0; i < PALETTE_SLOTS; i++, p += 3)
+  {
+    targetPalette[i] = CRGB(p[0], p[1], p[2]);
+  }
+}
+
+/**
+   Serial console commands: 's' prints frame statistics and starts a new measurement window,
+   'h' prints the RAM report
+*/
+void handleSerial()
+{
+  while (Serial.available() > 0)
+  {
+    switch (Serial.read())
+    {
+    case 's':
+      frameTimer.report(Serial);
+      frameTimer.reset();
+      break;
+    case 'h':
+      printRamReport(Serial);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/**
+   GET /metrics: counters in Prometheus text format. The body is formatted into
+   a static buffer in RAM and sent with its length, ESP8266WebServer still
+   allocates Strings for parsing the request and for the response headers.
+*/
+void handleMetrics()
+{
+  static char body[METRICS_BUF_SIZE];
+  size_t len = metrics.write(body, sizeof(body), frameTimer, paletteFetch.bytesReceived());
+  metricsServer.send(200, "text/plain; version=0.0.4", body, len);
+}
+
 void loop()
 {
+  handleSerial();
+  tickWifi();
+  if (mqttEnabled())
+  {
+    if (!mqttClient.connected())
+    {
+      mqttConnect();
+    }
+    mqttClient.loop();
+  }
+  metricsServer.handleClient();
+  if (!frameTimer.due())
+  {
+    return; // Let the WiFi stack run until the next frame deadline
+  }
   unsigned long now = millis();
-  if (lastPing + 10000 < now)
+  // A poll that falls due while WiFi is down waits for the reconnect, it doesn't count as a failure
+  if (pollScheduler.due() && WiFi.status() == WL_CONNECTED && paletteFetch.idle() && !mqttPaletteFresh() &&
+      paletteRelay.upstreamAllowed())
   {
     requestData();
-    lastPing = now;
   }
-  runLedEffect();
-  FastLED.show();
-  FastLED.delay(1000 / UPDATES_PER_SECOND);
+  pollData();
+  if (paletteRelay.poll() && decodePalette(paletteRelay.payload(), paletteRelay.payloadLength()))
+  {
+    Serial.println(F("Got palette from relay gateway"));
+    usePalette(paletteRelay.payload(), paletteRelay.payloadLength(), true);
+  }
+  updatePaletteWindow();
+  if (currentPalette != targetPalette)
+  {
+    // Changed entries are picked up by paletteLut.update() in runLedEffect()
+    nblendPaletteTowardPalette(currentPalette, targetPalette, PALETTE_BLEND_CHANGES);
+  }
+  // Pushing out an identical frame only keeps interrupts off and hurts WiFi
+  if (runLedEffect() || now - lastShow >= LED_REFRESH_MS)
+  {
+    showPending = true;
+  }
+  // While the output is still sending the previous frame keep rendering into leds[],
+  // the newest frame is handed over as soon as it's free
+  if (showPending && ledOutput.ready())
+  {
+    frameTimer.beginShow();
+    ledOutput.show();
+    frameTimer.endShow();
+    lastShow = now;
+    showPending = false;
+  }
+  frameTimer.endFrame();
 }
 
 /**
@@ -182,41 +709,19 @@ void switchMode(byte *payload, unsigned int length)
   //
   // FastLED provides several 'preset' palettes: RainbowColors_p, RainbowStripeColors_p,
   // OceanColors_p, CloudColors_p, LavaColors_p, ForestColors_p, and PartyColors_p.
-  switch (payload[2])
+  uint8_t preset = payload[2] - '0';
+  if (preset >= PRESET_PALETTE_COUNT)
   {
-  case '0':
-    Serial.println("Switch to RainbowColors_p");
-    currentPalette = RainbowColors_p;
-    break;
-  case '1':
-    Serial.println("Switch to RainbowStripeColors_p");
-    currentPalette = RainbowStripeColors_p;
-    break;
-  case '2':
-    Serial.println("Switch to OceanColors_p");
-    currentPalette = OceanColors_p;
-    break;
-  case '3':
-    Serial.println("Switch to CloudColors_p");
-    currentPalette = CloudColors_p;
-    break;
-  case '4':
-    Serial.println("Switch to LavaColors_p");
-    currentPalette = LavaColors_p;
-    break;
-  case '5':
-    Serial.println("Switch to ForestColors_p");
-    currentPalette = ForestColors_p;
-    break;
-  case '6':
-    Serial.println("Switch to PartyColors_p");
-    currentPalette = PartyColors_p;
-    break;
-  default:
-    Serial.print("Invalid palette: ");
-    Serial.println(payload[2]);
-    break;
+    Serial.print(F("Invalid palette: "));
+    Serial.println((char)payload[2]);
+    return;
   }
+  PresetPalette entry;
+  memcpy_P(&entry, &PRESET_PALETTES[preset], sizeof(entry));
+  Serial.print(F("Switch to "));
+  Serial.println(FPSTR(entry.name));
+  targetPalette = *entry.palette;
+  ledsDirty = true;
 }
 
 /**
@@ -227,58 +732,51 @@ void setSolidColor(byte *payload, unsigned int length)
   r = payload[2];
   g = payload[3];
   b = payload[4];
+  ledsDirty = true;
   Serial.println(r);
   Serial.println(g);
   Serial.println(b);
 }
 
+/**
+   Select an effect by its position in Effects, e.g. "e,1" for the solid colour
+*/
 void setActiveEffect(byte *payload, unsigned int length)
 {
-  if ((payload[2] >= '0') && (payload[2] <= '2'))
+  uint8_t effect = payload[2] - '0';
+  if (effect < Effects::count)
   {
-    activeEffect = payload[2];
-    Serial.println("activeEffect set");
+    activeEffect = effect;
+    Serial.println(F("activeEffect set"));
   }
   else
   {
-    Serial.print("Invalid effect: ");
-    Serial.println(payload[2]);
-  }
-}
-
-void FillLEDsFromPaletteColors(uint8_t colorIndex)
-{
-  for (int i = 0; i < NUM_LEDS; i++)
-  {
-    leds[i] = ColorFromPalette(currentPalette, colorIndex, brightness, currentBlending);
-    colorIndex += (int)255/NUM_LEDS;
+    Serial.print(F("Invalid effect: "));
+    Serial.println((char)payload[2]);
   }
 }
 
-void FillLEDsWithSolidColor()
+/**
+   Render the current effect into leds[] if anything affecting it has changed.
+   Returns true if leds[] was updated and needs to be shown.
+*/
+bool runLedEffect()
 {
-  for (int i = 0; i < NUM_LEDS; i++)
+  static uint8_t renderedEffect = 0xFF;
+  static uint8_t renderedBrightness = 0;
+  if (activeEffect != renderedEffect || brightness != renderedBrightness)
   {
-    leds[i].setRGB(r, g, b);
+    renderedEffect = activeEffect;
+    renderedBrightness = brightness;
+    ledsDirty = true;
   }
-}
-
-
-void runLedEffect()
-{
-  // Serial.println(currentMode);
-  switch (currentMode)
+  EffectContext ctx = {leds, paletteLut, currentPalette, brightness, currentBlending,
+                       havePalette, CRGB(r, g, b), ledsDirty};
+  if (!Effects::changed(activeEffect, ctx))
   {
-  case '0':
-    static uint8_t startIndex = 0;
-    // startIndex = startIndex + 1; /* motion speed */
-    FillLEDsFromPaletteColors(startIndex);
-    break;
-  case '1':
-    FillLEDsWithSolidColor();
-    break;
-  default:
-    Serial.println("Got invalid mode (in runLedEffect)");
-    break;
+    return false;
   }
+  Effects::render(activeEffect, ctx);
+  ledsDirty = false;
+  return true;
 }
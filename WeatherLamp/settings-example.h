@@ -5,6 +5,21 @@
 #define MQTT_PASSWORD "mqtt_password"
 #define MQTT_SUB_TOPIC  "led/control"
 #define MQTT_PUB_TOPIC  "led/ping"
+// Retained binary palettes, formatted with latitude and longitude
+#define MQTT_PALETTE_TOPIC "weatherlamp/palette/%s_%s"
+#define MQTT_RECONNECT_MS 5000
+// Fall back to HTTP polling if no palette has arrived over MQTT for this long
+#define MQTT_PALETTE_STALE_MS (45 * 60 * 1000UL)
+
+#define NTP_SERVER "pool.ntp.org"
+// Palettes are polled over HTTP, or with PALETTE_TRANSPORT_UDP from py/paletteudpserver.py at PALETTE_UDP_URL
+#define PALETTE_TRANSPORT PALETTE_TRANSPORT_HTTP
+#define PALETTE_UDP_URL "udp://porr.rista.fi/weatherlamp.bin"
+// Share palettes with lamps at the same location on the LAN, one gateway fetches for all:
+// RELAY_OFF, RELAY_AUTO (may become the gateway) or RELAY_FOLLOWER (never does)
+#define RELAY_MODE RELAY_OFF
+// Prometheus metrics are served at http://<lamp>:METRICS_PORT/metrics
+#define METRICS_PORT 9100
 
 #define AP_NAME  "PikkuJoulu"
 #define NUM_LEDS 6
@@ -18,5 +33,9 @@
 #define LED_TYPE    WS2812B
 // #define LED_TYPE    LPD8806
 #define COLOR_ORDER GRB
+// LED_OUTPUT_FASTLED works with any LED_TYPE but blocks interrupts while sending.
+// For long WS2812 strips use LED_OUTPUT_UART1 (data on D4) or LED_OUTPUT_DMA (data on RX),
+// they need the NeoPixelBus library. LED_NEO_FEATURE NeoRgbFeature etc. if not GRB.
+#define LED_OUTPUT LED_OUTPUT_FASTLED
 CRGB leds[NUM_LEDS];
 #define UPDATES_PER_SECOND 50
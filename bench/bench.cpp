@@ -0,0 +1,244 @@
+/**************************************************************************************
+   Host-native benchmark of the render and decode hot paths
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Build and run with PlatformIO:
+
+     pio run -e native && .pio/build/native/program
+
+   Prints CSV to stdout, one row per benchmark and strip length:
+
+     bench,leds,iterations,ns_per_call,ns_per_led
+
+   ns_per_call is the fastest of BENCH_REPEATS runs, so a busy host inflates
+   the numbers less. Absolute values depend on the host, compare runs made on
+   the same machine. Effects are timed through the same EffectRegistry
+   dispatch the sketch uses.
+
+   Before timing anything, a few checks of host-testable logic are run. A
+   failing one is printed to stderr and the program exits with 1.
+
+ **************************************************************************************/
+
+#include <chrono>
+#include <stdio.h>
+#include <FastLED.h>
+#include "PaletteLut.h"
+#include "PaletteFormat.h"
+#include "Effects.h"
+#include "PollScheduler.h"
+
+#define BENCH_MAX_LEDS 4096
+#define BENCH_REPEATS 5
+#define BENCH_MIN_RUN_NS 20000000LL // Grow iterations until one run takes 20 ms
+
+CRGB leds[BENCH_MAX_LEDS];
+CRGBPalette16 currentPalette;
+PaletteLut paletteLut;
+uint8_t brightness = 128;
+EffectContext ctx = {leds, paletteLut, currentPalette, brightness, LINEARBLEND, true, CRGB(10, 20, 30), true};
+volatile uint32_t sink; // Keeps the compiler from dropping the work
+unsigned long shimMillis = 1000;
+
+uint8_t payload[PALETTE_PAYLOAD_MAX];
+size_t payloadLen;
+
+typedef void (*BenchFn)(uint8_t);
+
+static long long nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+template <uint16_t N>
+void fillFromPaletteDirect(uint8_t colorIndex)
+{
+  // Rendering before PaletteLut: one ColorFromPalette() per LED
+  static const uint32_t step = N > 1 ? (((uint32_t)PALETTE_LUT_SPAN << 16) + (N - 1) / 2) / (N - 1) : 0;
+  uint32_t pos = 0x8000;
+  for (uint16_t i = 0; i < N; i++)
+  {
+    leds[i] = ColorFromPalette(currentPalette, (uint8_t)(colorIndex + (pos >> 16)), brightness, LINEARBLEND);
+    pos += step;
+  }
+}
+
+template <uint16_t N>
+void renderEffect(uint8_t effect)
+{
+  typedef EffectRegistry<PaletteEffect<N>, SolidEffect<N> > Effects;
+  Effects::render(effect, ctx);
+}
+
+template <uint16_t N>
+void renderPaletteEffect(uint8_t)
+{
+  renderEffect<N>(0);
+}
+
+template <uint16_t N>
+void renderSolidEffect(uint8_t)
+{
+  renderEffect<N>(1);
+}
+
+void rebuildLut(uint8_t colorIndex)
+{
+  // Brightness change forces a full rebuild, e.g. after a control message
+  paletteLut.update(currentPalette, colorIndex | 1, LINEARBLEND);
+}
+
+void decodePayload(uint8_t)
+{
+  // Validation plus copying the first window into a palette, like decodePalette()
+  PaletteHeader header;
+  if (parsePalettePayload(payload, payloadLen, header) != PALETTE_OK)
+  {
+    return;
+  }
+  const uint8_t *p = payload + header.headerSize;
+  for (int i = 0; i < 16; i++, p += 3)
+  {
+    currentPalette[i] = CRGB(p[0], p[1], p[2]);
+  }
+}
+
+void buildPayload(uint8_t slots)
+{
+  uint8_t *p = payload;
+  *p++ = 'W';
+  *p++ = 'L';
+  *p++ = PALETTE_FORMAT_VERSION;
+  *p++ = PALETTE_HEADER_SIZE;
+  *p++ = slots;
+  *p++ = 0;
+  uint32_t baseTime = 1600000000;
+  for (int i = 0; i < 4; i++)
+  {
+    *p++ = baseTime >> (8 * i);
+  }
+  *p++ = 30; // Slot minutes
+  *p++ = 0;
+  *p++ = (slots * 30) & 0xFF; // Valid minutes
+  *p++ = (slots * 30) >> 8;
+  for (int i = 0; i < 3 * slots; i++)
+  {
+    *p++ = i * 7;
+  }
+  uint32_t crc = paletteCrc32(payload, p - payload);
+  for (int i = 0; i < 4; i++)
+  {
+    *p++ = crc >> (8 * i);
+  }
+  payloadLen = p - payload;
+}
+
+/**
+   Time fn and print one CSV row. leds is only used for the ns_per_led column,
+   0 for benchmarks that don't scale with the strip length.
+*/
+void run(const char *name, uint16_t ledCount, BenchFn fn)
+{
+  long iterations = 1;
+  long long best = 0;
+  for (;;)
+  {
+    long long start = nowNs();
+    for (long i = 0; i < iterations; i++)
+    {
+      fn((uint8_t)i);
+    }
+    long long elapsed = nowNs() - start;
+    if (elapsed >= BENCH_MIN_RUN_NS)
+    {
+      best = elapsed;
+      break;
+    }
+    iterations *= 2;
+  }
+  for (int repeat = 1; repeat < BENCH_REPEATS; repeat++)
+  {
+    long long start = nowNs();
+    for (long i = 0; i < iterations; i++)
+    {
+      fn((uint8_t)i);
+    }
+    long long elapsed = nowNs() - start;
+    if (elapsed < best)
+    {
+      best = elapsed;
+    }
+  }
+  for (uint16_t i = 0; i < ledCount; i++)
+  {
+    sink += leds[i].r + leds[i].g + leds[i].b;
+  }
+  double perCall = (double)best / iterations;
+  printf("%s,%u,%ld,%.1f,%.3f\n", name, ledCount, iterations, perCall, ledCount ? perCall / ledCount : 0.0);
+}
+
+/**
+   Server hints must be capped before they're converted to milliseconds, a
+   year of max-age would wrap around to about 17 days in 32 bits
+*/
+int checkPollHints()
+{
+  static const unsigned long HINTS_S[] = {31536000UL, 315360000UL, 0xFFFFFFFFUL};
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(HINTS_S) / sizeof(HINTS_S[0]); i++)
+  {
+    PollScheduler scheduler(10000, 15 * 60 * 1000UL);
+    scheduler.begin(1, 0);
+    scheduler.success(HINTS_S[i]);
+    unsigned long successIn = scheduler.nextIn();
+    scheduler.failure(HINTS_S[i]);
+    unsigned long failureIn = scheduler.nextIn();
+    // +-10 % jitter around the cap
+    unsigned long low = POLL_MAX_HINT_S * 1000 / 10 * 9, high = POLL_MAX_HINT_S * 1000 / 10 * 11;
+    if (successIn < low || successIn > high || failureIn < low || failureIn > high)
+    {
+      fprintf(stderr, "check_poll_hints: hint %lu s scheduled in %lu ms (success), %lu ms (failure)\n", HINTS_S[i],
+              successIn, failureIn);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+template <uint16_t N>
+void runFills()
+{
+  run("fill_palette_direct", N, fillFromPaletteDirect<N>);
+  run("fill_palette_lut", N, renderPaletteEffect<N>);
+  run("fill_solid", N, renderSolidEffect<N>);
+}
+
+int main()
+{
+  if (checkPollHints())
+  {
+    return 1;
+  }
+
+  currentPalette = RainbowColors_p;
+  paletteLut.update(currentPalette, brightness, LINEARBLEND);
+
+  printf("bench,leds,iterations,ns_per_call,ns_per_led\n");
+  runFills<10>();
+  runFills<30>();
+  runFills<60>();
+  runFills<150>();
+  runFills<300>();
+  runFills<1024>();
+  runFills<4096>();
+
+  run("lut_rebuild", 0, rebuildLut);
+  buildPayload(16);
+  run("decode_payload_16", 0, decodePayload);
+  buildPayload(PALETTE_MAX_SLOTS);
+  run("decode_payload_96", 0, decodePayload);
+  return 0;
+}
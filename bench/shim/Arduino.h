@@ -0,0 +1,29 @@
+/**************************************************************************************
+   Minimal Arduino API for the native benchmark build
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   Only what the host-compiled WeatherLamp modules use. Anything touching
+   hardware or the network is not available here on purpose.
+
+ **************************************************************************************/
+
+#ifndef ARDUINO_SHIM_H
+#define ARDUINO_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define F(s) (s)
+#define pgm_read_ptr(addr) (*(void *const *)(addr))
+
+// Host clock for the modules that schedule with millis(), the bench sets it
+extern unsigned long shimMillis;
+inline unsigned long millis() { return shimMillis; }
+
+#endif
@@ -0,0 +1,44 @@
+#include "FastLED.h"
+
+const TProgmemRGBPalette16 RainbowColors_p = {
+    0xFF0000, 0xD52A00, 0xAB5500, 0xAB7F00, 0xABAB00, 0x56D500, 0x00FF00, 0x00D52A,
+    0x00AB55, 0x0056AA, 0x0000FF, 0x2A00D5, 0x5500AB, 0x7F0081, 0xAB0055, 0xD5002B};
+
+/**
+   Same arithmetic as FastLED's ColorFromPalette() for 16-entry palettes
+*/
+CRGB ColorFromPalette(const CRGBPalette16 &pal, uint8_t index, uint8_t brightness, TBlendType blendType)
+{
+  uint8_t hi4 = index >> 4;
+  uint8_t lo4 = index & 0x0F;
+  const CRGB &entry = pal[hi4];
+  uint8_t red1 = entry.r;
+  uint8_t green1 = entry.g;
+  uint8_t blue1 = entry.b;
+
+  if (lo4 && blendType != NOBLEND)
+  {
+    const CRGB &next = pal[(hi4 + 1) & 0x0F];
+    uint8_t f2 = lo4 << 4;
+    uint8_t f1 = 255 - f2;
+    red1 = scale8(red1, f1) + scale8(next.r, f2);
+    green1 = scale8(green1, f1) + scale8(next.g, f2);
+    blue1 = scale8(blue1, f1) + scale8(next.b, f2);
+  }
+
+  if (brightness != 255)
+  {
+    if (brightness)
+    {
+      brightness++; // adjust for rounding
+      red1 = scale8(red1, brightness);
+      green1 = scale8(green1, brightness);
+      blue1 = scale8(blue1, brightness);
+    }
+    else
+    {
+      red1 = green1 = blue1 = 0;
+    }
+  }
+  return CRGB(red1, green1, blue1);
+}
@@ -0,0 +1,71 @@
+/**************************************************************************************
+   Minimal FastLED API for the native benchmark build
+   Copyright 2020 Aapo Rista
+   MIT license
+
+   CRGB, CRGBPalette16 and ColorFromPalette() behave like FastLED 3.3 with
+   FASTLED_SCALE8_FIXED, so timings and colours are comparable with the lamp.
+   There is no controller or show(), the benchmark only measures rendering.
+
+ **************************************************************************************/
+
+#ifndef FASTLED_SHIM_H
+#define FASTLED_SHIM_H
+
+#include <Arduino.h>
+
+static inline uint8_t scale8(uint8_t i, uint8_t scale)
+{
+  return ((uint16_t)i * (1 + (uint16_t)scale)) >> 8;
+}
+
+struct CRGB
+{
+  uint8_t r, g, b;
+
+  CRGB() {}
+  CRGB(uint8_t ir, uint8_t ig, uint8_t ib) : r(ir), g(ig), b(ib) {}
+  CRGB(uint32_t colorcode) : r(colorcode >> 16), g(colorcode >> 8), b(colorcode) {}
+  CRGB &setRGB(uint8_t nr, uint8_t ng, uint8_t nb)
+  {
+    r = nr;
+    g = ng;
+    b = nb;
+    return *this;
+  }
+  bool operator==(const CRGB &rhs) const { return r == rhs.r && g == rhs.g && b == rhs.b; }
+  bool operator!=(const CRGB &rhs) const { return !(*this == rhs); }
+};
+
+typedef uint32_t TProgmemRGBPalette16[16];
+
+struct CRGBPalette16
+{
+  CRGB entries[16];
+
+  CRGBPalette16() {}
+  CRGBPalette16(const TProgmemRGBPalette16 &rhs)
+  {
+    for (uint8_t i = 0; i < 16; i++)
+    {
+      entries[i] = CRGB(rhs[i]);
+    }
+  }
+  CRGB &operator[](uint8_t i) { return entries[i]; }
+  const CRGB &operator[](uint8_t i) const { return entries[i]; }
+  bool operator==(const CRGBPalette16 &rhs) const { return memcmp(entries, rhs.entries, sizeof(entries)) == 0; }
+  bool operator!=(const CRGBPalette16 &rhs) const { return !(*this == rhs); }
+};
+
+enum TBlendType
+{
+  NOBLEND = 0,
+  LINEARBLEND = 1
+};
+
+CRGB ColorFromPalette(const CRGBPalette16 &pal, uint8_t index, uint8_t brightness = 255,
+                      TBlendType blendType = LINEARBLEND);
+
+extern const TProgmemRGBPalette16 RainbowColors_p;
+
+#endif
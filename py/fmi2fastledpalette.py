@@ -1,42 +1,69 @@
 import sys
 import datetime
+import numpy as np
 import pandas as pd
-import re
 import requests
 import xml.etree.ElementTree as et
-from io import StringIO
 import json
 
+from palettefile import encode_palette, write_if_changed
+
 api_url = 'https://opendata.fmi.fi/wfs'
 resample = '30min'
 rain_factor = 2  # this is 1/resample in hours, e.g. 30min->2, 10min->6, 60min->1
+# Elements picked out of multipointcoverage responses: prefix, local name, what it holds
+wfs_elements = [
+    ('swe', 'field', 'field'),
+    ('gmlcov', 'positions', 'positions'),
+    ('gml', 'doubleOrNilReasonTupleList', 'values'),
+    ('om', 'observedProperty', 'property'),
+]
 
 
 def get_fmidata_multipointcoverage(parameters):
-    r = requests.get(f'{api_url}?{parameters}')
-    # XML root and namespaces
-    root = et.fromstring(r.text)
-    namespaces = dict([node for _, node in et.iterparse(StringIO(r.text), events=['start-ns'])])
-    # Extract name list
-    names = list(map(lambda f: f.attrib['name'], root.findall('.//swe:field', namespaces)))
-    # Extract Unix timestamps
-    timestamps = re.split(r'\s+', root.find('.//gmlcov:positions', namespaces).text)[3:-1:3]
+    """
+    Fetch a multipointcoverage query as a wide DataFrame, one column per parameter.
+
+    The response is parsed incrementally while it downloads. Elements are dropped
+    as soon as they have been read, so only the two large text blobs (positions
+    and values) are in memory at a time, and they go straight into NumPy arrays.
+    """
+    r = requests.get(f'{api_url}?{parameters}', stream=True)
+    parser = et.XMLPullParser(events=['start-ns', 'end'])
+    namespaces = {}
+    names = []
+    timestamps = values = None
+    property_url = None
+    tags = {}
+    for chunk in r.iter_content(chunk_size=65536):
+        parser.feed(chunk)
+        for event, node in parser.read_events():
+            if event == 'start-ns':
+                prefix, uri = node
+                namespaces[prefix] = uri
+                tags = {f'{{{namespaces[prefix]}}}{name}': key
+                        for prefix, name, key in wfs_elements if prefix in namespaces}
+                continue
+            key = tags.get(node.tag)
+            if key == 'field':
+                names.append(node.attrib['name'])
+            elif key == 'positions':
+                # lat lon time triplets, keep the Unix timestamps
+                timestamps = np.array(node.text.split(), dtype=float).reshape(-1, 3)[:, 2]
+            elif key == 'values':
+                values = np.array(node.text.split(), dtype=float)
+            elif key == 'property':
+                property_url = node.attrib['{http://www.w3.org/1999/xlink}href']
+            node.clear()
+    parser.close()
+    print(f'Properties: {property_url}')
     # Convert Unix timestamps to datetimes with Helsinki timezone
-    datetimeindex = pd.to_datetime(sorted(timestamps * len(names)), unit='s')
+    datetimeindex = pd.to_datetime(timestamps, unit='s')
     datetimeindex = datetimeindex.tz_localize(tz='UTC').tz_convert('Europe/Helsinki')
-    # Extract data
-    values = re.split(r'\s+', root.find('.//gml:doubleOrNilReasonTupleList', namespaces).text)[1:-1]
-    # Get URL for and print property explanations
-    property_url = root.find('.//om:observedProperty', namespaces).attrib[
-        '{http://www.w3.org/1999/xlink}href']
-    print(f'Properties: {property_url}')
-    # Create and return DataFrame
-    df = pd.DataFrame({
-        'name': names * len(timestamps),
-        'value': values},
-        index=datetimeindex)
-    df['value'] = pd.to_numeric(df['value'])  # arvo floatiksi
-    df.index.name = 'time'  # Nimetään indeksi
+    datetimeindex.name = 'time'  # Nimetään indeksi
+    # Values are in time order, one value per field for each position
+    df = pd.DataFrame(values.reshape(len(timestamps), len(names)), index=datetimeindex, columns=names)
+    df.columns.name = 'name'
     return df
 
 
@@ -45,47 +72,33 @@ def get_fmidata_multipointcoverage(parameters):
 latlon = '60.19,24.95'
 # List of stored queries https://ilmatieteenlaitos.fi/tallennetut-kyselyt
 query = 'fmi::forecast::hirlam::surface::point::multipointcoverage'
-df = get_fmidata_multipointcoverage(f'request=getFeature&storedquery_id={query}&latlon={latlon}&timestep=10')
-dfp = df.pivot_table(index='time', columns='name', values='value')
+dfp = get_fmidata_multipointcoverage(f'request=getFeature&storedquery_id={query}&latlon={latlon}&timestep=10')
 rain = dfp[['Precipitation1h', 'TotalCloudCover']]
 # rain.head(50)
 rain.resample('30min').sum().head(20)
 rain16 = rain.resample('30min').sum().head(16)
 cloud16 = rain.resample('30min').mean().head(16)
 # print(rain16)
-colors = []
-readable_colors = []
 white = [100, 250, 200]
 
-for ind in rain16.index:
-    rain, cloud = round(rain16['Precipitation1h'][ind], 1), int(cloud16['TotalCloudCover'][ind])
-    if rain > 0:
-        if rain >= 1.0:
-            curr = [250, 100, 0]
-        elif rain >= 0.2:
-            curr = [200, 200, 0]
-        else:
-            curr = white
-        #rain_g = int(rain * rain_factor * 25) + 25
-        #if rain_g > 255:
-        #    rain_g = 255
-        #curr = [0, 0, rain_g]
-        #curr = [0, 0, rain_g]
-    elif cloud < 80:
-        # g = b = int(255 * (100 - cloud) / 100)
-        g = b = 200
-        r = int(100 - cloud) * 2
-        curr = [r, g, b]
-    else:
-        curr = white
-    colors += curr
-    readable_colors.append([ind.isoformat()] + curr)
-    print(curr, ind, rain, cloud)
-
+# Colour per slot: precipitation first, then cloud cover
+rain = rain16['Precipitation1h'].round(1).to_numpy()
+# A slot with no cloud cover values averages to NaN, which astype(int) would turn into garbage
+missing_cloud = cloud16['TotalCloudCover'].isna()
+if missing_cloud.any():
+    raise ValueError(f'No TotalCloudCover for {", ".join(t.isoformat() for t in cloud16.index[missing_cloud])}')
+cloud = cloud16['TotalCloudCover'].to_numpy().astype(int)
+cloud_g = np.full_like(cloud, 200)
+cloud_colors = np.stack([(100 - cloud) * 2, cloud_g, cloud_g], axis=1)
+colors = np.select(
+    [(rain >= 1.0)[:, None], (rain >= 0.2)[:, None], (rain > 0)[:, None], (cloud < 80)[:, None]],
+    [[250, 100, 0], [200, 200, 0], white, cloud_colors],
+    default=white,
+).astype(np.uint8)
+readable_colors = [[ind.isoformat()] + curr for ind, curr in zip(rain16.index, colors.tolist())]
+print(pd.DataFrame({'rain': rain, 'cloud': cloud, 'color': colors.tolist()}, index=rain16.index))
 
-arr = bytearray(colors)
-with open(sys.argv[1], 'wb') as f:
-    f.write(arr)
 
-with open(sys.argv[1] + '.json', 'wt') as f:
-    f.write(json.dumps(readable_colors, indent=2))
+# Leave unchanged files alone so the web server can answer with 304 Not Modified
+write_if_changed(sys.argv[1], encode_palette(colors, int(rain16.index[0].timestamp())))
+write_if_changed(sys.argv[1] + '.json', json.dumps(readable_colors, indent=2).encode())
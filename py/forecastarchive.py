@@ -0,0 +1,103 @@
+import datetime
+import gzip
+import json
+import logging
+import os
+import threading
+import zlib
+from typing import Dict, Iterator, Optional
+
+# Append-only archive of upstream responses and the palettes generated from them,
+# for replaying the generator offline. One gzip file per UTC day, one JSON record
+# per line:
+#
+#   {"type": "response", "time": ..., "cast_type": ..., "lat": ..., "lon": ..., "id": ..., "data": {...}}
+#   {"type": "palette", "time": ..., "lat": ..., "lon": ..., "hours": ..., "inputs": {cast_type: id}, "palette": hex}
+#
+# Responses are stored once, when downloaded, and palettes refer to them by id.
+# Every record is its own gzip member, so appending never rewrites earlier data and
+# gzip.open() reads the members back as one stream.
+
+ARCHIVE_SUFFIX = ".jsonl.gz"
+
+
+def data_id(data: dict) -> str:
+    """
+    Identify a response body by the CRC-32 of its compact JSON.
+    """
+    return f"{zlib.crc32(json.dumps(data, separators=(',', ':'), sort_keys=True).encode()):08x}"
+
+
+class ForecastArchive:
+    def __init__(self, path: str):
+        self.path = path
+        self.lock = threading.Lock()  # Batch mode archives from many threads
+
+    def file_for(self, when: float) -> str:
+        day = datetime.datetime.fromtimestamp(when, tz=datetime.timezone.utc).strftime("%Y-%m-%d")
+        return os.path.join(self.path, day + ARCHIVE_SUFFIX)
+
+    def append(self, record: dict):
+        line = (json.dumps(record, separators=(",", ":")) + "\n").encode()
+        member = gzip.compress(line)  # Outside the lock, it's the slow part
+        with self.lock:
+            os.makedirs(self.path, exist_ok=True)
+            with open(self.file_for(record["time"]), "ab") as f:
+                f.write(member)
+
+    def add_response(self, cast_type: str, lat: str, lon: str, data: dict, when: float) -> str:
+        id_ = data_id(data)
+        self.append(
+            {"type": "response", "time": when, "cast_type": cast_type, "lat": lat, "lon": lon, "id": id_, "data": data}
+        )
+        return id_
+
+    def add_palette(self, lat: str, lon: str, hours: int, inputs: Dict[str, str], palette: bytes, when: float):
+        self.append(
+            {
+                "type": "palette",
+                "time": when,
+                "lat": lat,
+                "lon": lon,
+                "hours": hours,
+                "inputs": inputs,
+                "palette": palette.hex(),
+            }
+        )
+
+    def records(self, start: Optional[float] = None, end: Optional[float] = None) -> Iterator[dict]:
+        """
+        Yield records in time order, optionally only those with start <= time < end.
+        """
+        try:
+            names = sorted(n for n in os.listdir(self.path) if n.endswith(ARCHIVE_SUFFIX))
+        except FileNotFoundError:
+            return
+        for name in names:
+            day_start = datetime.datetime.strptime(name[: -len(ARCHIVE_SUFFIX)], "%Y-%m-%d")
+            day_start = day_start.replace(tzinfo=datetime.timezone.utc).timestamp()
+            if (end is not None and day_start >= end) or (start is not None and day_start + 86400 <= start):
+                continue  # Whole file outside the range, skip decompressing it
+            try:
+                with gzip.open(os.path.join(self.path, name), "rt") as f:
+                    for line in f:
+                        record = json.loads(line)
+                        if (start is None or record["time"] >= start) and (end is None or record["time"] < end):
+                            yield record
+            except (EOFError, gzip.BadGzipFile, ValueError):
+                # An interrupted append leaves a truncated last member, the records before it are fine
+                logging.warning(f"{name} ends with a damaged record, skipped it")
+
+
+_archives: Dict[str, ForecastArchive] = {}
+_archives_lock = threading.Lock()
+
+
+def get_archive(path: str) -> ForecastArchive:
+    """
+    Shared archive for path, so all threads writing to it use the same lock.
+    """
+    with _archives_lock:
+        if path not in _archives:
+            _archives[path] = ForecastArchive(path)
+        return _archives[path]
@@ -0,0 +1,221 @@
+import argparse
+import asyncio
+import collections
+import logging
+import random
+import time
+from typing import Dict, List, Optional, Tuple
+from urllib.parse import urlsplit
+
+# Request as sent by PaletteFetch::sendRequest() in the firmware
+REQUEST = "GET {path} HTTP/1.1\r\nHost: {host}\r\nUser-Agent: WeatherLamp\r\nConnection: {connection}\r\n"
+POLL_INTERVAL = 10.0  # POLL_INTERVAL_MS in WeatherLamp.cpp
+FETCH_TIMEOUT = 5.0  # FETCH_TIMEOUT_MS in PaletteFetch.h
+
+
+class Stats:
+    def __init__(self):
+        self.latencies: List[float] = []
+        self.statuses: Dict[str, int] = collections.Counter()
+        self.errors: Dict[str, int] = collections.Counter()
+        self.bytes = 0
+        self.connections = 0
+
+    def report(self, elapsed: float, lamps: int) -> str:
+        count = len(self.latencies) + sum(self.errors.values())
+        lines = [
+            f"{lamps} lamps, {elapsed:.0f} s: {count} requests, {count / elapsed:.1f} req/s, "
+            f"{self.connections} connections, {self.bytes / elapsed / 1024:.1f} KiB/s received"
+        ]
+        if self.latencies:
+            ordered = sorted(self.latencies)
+            percentiles = ", ".join(
+                f"p{p} {ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))] * 1000:.1f}"
+                for p in (50, 90, 99)
+            )
+            lines.append(f"  latency ms: {percentiles}, max {ordered[-1] * 1000:.1f}")
+        if self.statuses:
+            lines.append("  status: " + ", ".join(f"{k} {v}" for k, v in sorted(self.statuses.items())))
+        if self.errors:
+            error_rate = 100 * sum(self.errors.values()) / count
+            lines.append(f"  errors {error_rate:.2f} %: " + ", ".join(f"{k} {v}" for k, v in self.errors.items()))
+        return "\n".join(lines)
+
+
+class Lamp:
+    """
+    One simulated lamp: polls the palette URL like the firmware does, on its own
+    connection, remembering the validators of the last 200 if asked to.
+    """
+
+    def __init__(self, number: int, url: str, args: argparse.Namespace, stats: Stats):
+        parts = urlsplit(url)
+        self.host = parts.hostname
+        self.port = parts.port or 80
+        self.host_header = parts.netloc
+        self.path = parts.path + (f"?{parts.query}" if parts.query else "")
+        self.number = number
+        self.args = args
+        self.stats = stats
+        self.etag: Optional[str] = None
+        self.last_modified: Optional[str] = None
+        self.streams: Optional[Tuple[asyncio.StreamReader, asyncio.StreamWriter]] = None
+
+    def request(self) -> bytes:
+        req = REQUEST.format(
+            path=self.path, host=self.host_header, connection="keep-alive" if self.args.keepalive else "close"
+        )
+        if self.etag:
+            req += f"If-None-Match: {self.etag}\r\n"
+        if self.last_modified:
+            req += f"If-Modified-Since: {self.last_modified}\r\n"
+        return (req + "\r\n").encode()
+
+    async def fetch(self) -> Tuple[int, Dict[str, str]]:
+        reused = self.streams is not None
+        if self.streams is None:
+            self.streams = await asyncio.open_connection(self.host, self.port)
+            self.stats.connections += 1
+        reader, writer = self.streams
+        status_line = b""
+        try:
+            writer.write(self.request())
+            await writer.drain()
+            status_line = await reader.readline()
+        except ConnectionError:
+            if not reused:
+                raise
+        if not status_line:
+            if not reused:
+                raise ConnectionResetError("closed by server")
+            # Server closed the idle keep-alive connection, retry once on a new one like PaletteFetch does
+            self.close()
+            return await self.fetch()
+        received = len(status_line)
+        status = int(status_line.split()[1])
+        headers = {}
+        while True:
+            raw = await reader.readline()
+            received += len(raw)
+            line = raw.decode("latin-1").strip()
+            if not line:
+                break
+            name, _, value = line.partition(":")
+            headers[name.strip().lower()] = value.strip()
+        length = int(headers.get("content-length", 0))
+        if length:
+            await reader.readexactly(length)
+        self.stats.bytes += received + length  # Headers included, like bytesReceived() in the firmware
+        if not self.args.keepalive or headers.get("connection", "").lower() == "close":
+            self.close()
+        return status, headers
+
+    def close(self):
+        if self.streams is not None:
+            self.streams[1].close()
+            self.streams = None
+
+    async def run(self, deadline: float):
+        # Lamps are switched on at different times
+        await asyncio.sleep(random.uniform(0, self.args.interval))
+        while time.monotonic() < deadline:
+            started = time.monotonic()
+            delay = self.args.interval
+            try:
+                status, headers = await asyncio.wait_for(self.fetch(), FETCH_TIMEOUT)
+            except asyncio.TimeoutError:
+                self.stats.errors["timeout"] += 1
+                self.close()
+            except (OSError, ValueError, IndexError, asyncio.IncompleteReadError) as err:
+                self.stats.errors[type(err).__name__] += 1
+                self.close()
+            else:
+                self.stats.latencies.append(time.monotonic() - started)
+                self.stats.statuses[str(status)] += 1
+                if status == 200 and self.args.conditional:
+                    self.etag = headers.get("etag")
+                    self.last_modified = headers.get("last-modified")
+                if self.args.honour_max_age and status in (200, 304) and "max-age=" in headers.get("cache-control", ""):
+                    delay = max(delay, float(headers["cache-control"].split("max-age=")[1].split(",")[0]))
+            delay *= 1 + random.uniform(-self.args.jitter, self.args.jitter)
+            await asyncio.sleep(max(0.0, min(started + delay, deadline) - time.monotonic()))
+        self.close()
+
+
+def lamp_url(args: argparse.Namespace, number: int) -> str:
+    lat = args.lat + random.uniform(-args.spread, args.spread)
+    lon = args.lon + random.uniform(-args.spread, args.spread)
+    return args.url.format(lat=f"{lat:.3f}", lon=f"{lon:.3f}", lamp=number)
+
+
+async def run_fleet(args: argparse.Namespace):
+    stats = Stats()
+    started = time.monotonic()
+    deadline = started + args.duration
+    lamps = [Lamp(n, lamp_url(args, n), args, stats) for n in range(args.lamps)]
+    tasks = [asyncio.ensure_future(lamp.run(deadline)) for lamp in lamps]
+    while not all(task.done() for task in tasks):
+        await asyncio.wait(tasks, timeout=args.report)
+        logging.info(stats.report(time.monotonic() - started, args.lamps))
+    print(stats.report(time.monotonic() - started, args.lamps))
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(add_help=True, description="Simulate a fleet of lamps polling a palette server")
+    parser.add_argument(
+        "--log",
+        dest="log",
+        choices=["DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"],
+        default="ERROR",
+        help="Set the logging level, INFO prints intermediate reports",
+    )
+    parser.add_argument(
+        "url",
+        help="Palette URL, {lat}, {lon} and {lamp} are replaced per lamp, "
+        "e.g. http://localhost:8080/weatherlamp.bin?lat={lat}&lon={lon}",
+    )
+    parser.add_argument("--lamps", type=int, default=100, help="Number of simulated lamps")
+    parser.add_argument("--duration", type=float, default=60, help="Seconds to run")
+    parser.add_argument("--interval", type=float, default=POLL_INTERVAL, help="Seconds between polls of one lamp")
+    parser.add_argument("--jitter", type=float, default=0.0, help="Vary each interval randomly by this fraction")
+    parser.add_argument(
+        "--conditional", action="store_true", help="Send If-None-Match and If-Modified-Since like the firmware"
+    )
+    parser.add_argument(
+        "--no-keepalive", dest="keepalive", action="store_false", help="New connection for every request"
+    )
+    parser.add_argument(
+        "--honour-max-age", action="store_true", help="Wait for Cache-Control max-age like the firmware does"
+    )
+    parser.add_argument("--lat", type=float, default=60.17, help="Centre of the lamps' locations")
+    parser.add_argument("--lon", type=float, default=24.94, help="Centre of the lamps' locations")
+    parser.add_argument("--spread", type=float, default=0.0, help="Lamps are placed randomly within +-spread degrees")
+    parser.add_argument("--report", type=float, default=10, help="Seconds between intermediate reports")
+    parser.add_argument("--seed", type=int, help="Random seed, for repeatable locations and start times")
+    args = parser.parse_args()
+    if args.lamps < 1 or args.duration <= 0 or args.interval <= 0:
+        parser.error("--lamps, --duration and --interval must be positive")
+    if not 0 <= args.jitter < 1:
+        parser.error("--jitter must be between 0 and 1")
+    if args.log:
+        logging.basicConfig(
+            level=getattr(logging, args.log),
+            datefmt="%Y-%m-%dT%H:%M:%S",
+            format="%(asctime)s.%(msecs)03dZ %(levelname)s %(message)s",
+        )
+        logging.Formatter.converter = time.gmtime  # Timestamps in UTC time
+    return args
+
+
+def main():
+    args = parse_args()
+    random.seed(args.seed)
+    loop = asyncio.new_event_loop()
+    try:
+        loop.run_until_complete(run_fleet(args))
+    finally:
+        loop.close()
+
+
+if __name__ == "__main__":
+    main()
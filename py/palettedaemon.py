@@ -0,0 +1,222 @@
+import argparse
+import collections
+import logging
+import random
+import threading
+import time
+import zlib
+from email.utils import formatdate
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from typing import Dict, NamedTuple, Optional, Tuple
+from urllib.parse import parse_qs, urlsplit
+
+from yr2fastledpalette import build_palette, make_session
+
+UPSTREAM_POOL_SIZE = 8
+RETRY_SECONDS = 60  # After a failed regeneration, stale palettes are served this long before the next try
+MIN_LIFETIME = 60  # Even if met.no's data has already expired, don't rebuild more often than this
+LAMP_SLOTS = 16  # PALETTE_SLOTS in WeatherLamp.cpp, the half hours a lamp shows at once
+MAX_AGE_SPREAD = 0.1  # max-age is varied +-10 % per response, so a tile's lamps don't all poll at once
+
+
+class Entry(NamedTuple):
+    data: bytes
+    etag: str
+    last_modified: float
+    expires: float
+
+
+class PaletteCache:
+    """
+    Encoded palettes in memory, one per location tile.
+
+    Lamps within the same tile share one palette, so the upstream requests and the
+    pandas work scale with the number of tiles, not lamps. A palette is regenerated
+    in the background when a lamp asks for it after it has expired, lamps keep getting
+    the old one meanwhile instead of waiting.
+
+    A palette expires with the upstream data it was built from. The upstream
+    responses are kept per tile with their Expires and Last-Modified, so a rebuild
+    only requests what met.no says has expired, and an unchanged forecast is
+    revalidated with a 304. Lamps slide their window along the bundle by the clock,
+    so the passing half hours only force a rebuild once the window would run past
+    the end of the bundle, right away with the shortest --hours.
+    """
+
+    def __init__(self, args: argparse.Namespace):
+        self.args = args
+        self.entries: "collections.OrderedDict[Tuple[str, str], Entry]" = collections.OrderedDict()
+        self.upstream: Dict[Tuple[str, str], Dict[str, dict]] = {}  # get_yrdata() cache entries by tile
+        self.locks = {}
+        self.lock = threading.Lock()  # Guards entries, upstream and locks
+        self.session = make_session(UPSTREAM_POOL_SIZE)  # Keeps connections to met.no open between rebuilds
+
+    def tile(self, lat: float, lon: float) -> Tuple[str, str]:
+        decimals = self.args.tile_decimals
+        return f"{lat:.{decimals}f}", f"{lon:.{decimals}f}"
+
+    def expiry(self, now: float, upstream: Dict[str, dict]) -> float:
+        # The first slot starts at the current half hour, the lamp can slide past it this many times
+        spare_slots = self.args.hours * 2 - LAMP_SLOTS
+        window_end = (now // 1800 + 1 + spare_slots) * 1800
+        expires = min([window_end] + [entry["expires"] for entry in upstream.values()])
+        return max(expires, now + MIN_LIFETIME)
+
+    def get(self, key: Tuple[str, str]) -> Optional[Entry]:
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is not None:
+                self.entries.move_to_end(key)
+                if time.time() < entry.expires:
+                    return entry
+            tile_lock = self.locks.setdefault(key, threading.Lock())
+        if entry is None:
+            # Nothing to serve yet, wait for the palette (or for whoever is already building it)
+            with tile_lock:
+                with self.lock:
+                    current = self.entries.get(key)
+                if current is not None:
+                    return current
+                return self.regenerate(key, None)
+        # Stale: serve it and rebuild in the background, unless that is already happening
+        if tile_lock.acquire(blocking=False):
+            threading.Thread(target=self.regenerate_locked, args=(key, entry, tile_lock), daemon=True).start()
+        return entry
+
+    def regenerate_locked(self, key: Tuple[str, str], old: Entry, tile_lock: threading.Lock):
+        try:
+            self.regenerate(key, old)
+        finally:
+            tile_lock.release()
+
+    def regenerate(self, key: Tuple[str, str], old: Optional[Entry]) -> Optional[Entry]:
+        lat, lon = key
+        tile_args = argparse.Namespace(lat=lat, lon=lon, hours=self.args.hours, historypath=self.args.historypath)
+        with self.lock:
+            upstream = self.upstream.setdefault(key, {})
+        started = time.monotonic()
+        now = time.time()
+        try:
+            data = build_palette(tile_args, self.session, memory=upstream)
+        except Exception:
+            logging.exception(f"Palette for {lat},{lon} failed")
+            if old is None:
+                return None
+            entry = old._replace(expires=now + RETRY_SECONDS)
+        else:
+            if old is not None and old.data == data:
+                entry = old._replace(expires=self.expiry(now, upstream))
+            else:
+                entry = Entry(data, f'"{zlib.crc32(data):08x}"', now, self.expiry(now, upstream))
+            logging.info(f"Palette for {lat},{lon} built in {time.monotonic() - started:.2f} s")
+        with self.lock:
+            self.entries[key] = entry
+            self.entries.move_to_end(key)
+            while len(self.entries) > self.args.max_tiles:
+                evicted, _ = self.entries.popitem(last=False)
+                self.locks.pop(evicted, None)
+                self.upstream.pop(evicted, None)
+        return entry
+
+
+class PaletteHandler(BaseHTTPRequestHandler):
+    cache: PaletteCache = None
+    protocol_version = "HTTP/1.1"  # Keep-alive, lamps reuse the connection
+
+    def do_GET(self):
+        url = urlsplit(self.path)
+        if url.path != self.cache.args.path:
+            self.send_error(404)
+            return
+        query = parse_qs(url.query)
+        try:
+            lat = float(query.get("lat", [self.cache.args.lat])[0])
+            lon = float(query.get("lon", [self.cache.args.lon])[0])
+        except (TypeError, ValueError):
+            self.send_error(400, "Bad or missing lat and lon")
+            return
+        if not (-90 <= lat <= 90 and -180 <= lon <= 180):
+            self.send_error(400, "lat or lon out of range")
+            return
+        entry = self.cache.get(self.cache.tile(lat, lon))
+        if entry is None:
+            self.send_response(503)
+            self.send_header("Retry-After", str(RETRY_SECONDS))
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        not_modified = self.headers.get("If-None-Match") == entry.etag
+        body = b"" if not_modified else entry.data
+        self.send_response(304 if not_modified else 200)
+        if not not_modified:
+            self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("ETag", entry.etag)
+        self.send_header("Last-Modified", formatdate(entry.last_modified, usegmt=True))
+        max_age = (entry.expires - time.time()) * random.uniform(1 - MAX_AGE_SPREAD, 1 + MAX_AGE_SPREAD)
+        self.send_header("Cache-Control", f"max-age={max(1, int(max_age))}")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format: str, *args):
+        logging.debug(f"{self.address_string()} {format % args}")
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(add_help=True)
+    parser.add_argument(
+        "--log",
+        dest="log",
+        choices=["DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"],
+        default="ERROR",
+        help="Set the logging level",
+    )
+    parser.add_argument("--host", default="0.0.0.0", help="Address to listen on")
+    parser.add_argument("--port", type=int, default=8080, help="HTTP port")
+    parser.add_argument("--path", default="/weatherlamp.bin", help="URL path of the palette")
+    parser.add_argument("--lat", help="Latitude for lamps that don't send lat and lon in the query string")
+    parser.add_argument("--lon", help="Longitude for lamps that don't send lat and lon in the query string")
+    parser.add_argument(
+        "--tile-decimals",
+        type=int,
+        default=2,
+        help="Lamps whose lat and lon round to the same decimals share a palette (2 is about 1 km)",
+    )
+    parser.add_argument(
+        "--max-tiles", type=int, default=10000, help="Least recently used tiles beyond this are dropped"
+    )
+    parser.add_argument("--hours", type=int, default=8, help="Hours of 30 minute slots to include (8-48)")
+    parser.add_argument(
+        "--historypath", help="Archive upstream responses and palettes, see yr2fastledpalette.py --replay"
+    )
+    args = parser.parse_args()
+    if not 8 <= args.hours <= 48:
+        parser.error("--hours must be between 8 and 48")
+    if not 0 <= args.tile_decimals <= 4:
+        parser.error("--tile-decimals must be between 0 and 4, met.no ignores more")
+    if args.log:
+        logging.basicConfig(
+            level=getattr(logging, args.log),
+            datefmt="%Y-%m-%dT%H:%M:%S",
+            format="%(asctime)s.%(msecs)03dZ %(levelname)s %(message)s",
+        )
+        logging.Formatter.converter = time.gmtime  # Timestamps in UTC time
+    return args
+
+
+def main():
+    args = parse_args()
+    PaletteHandler.cache = PaletteCache(args)
+    server = ThreadingHTTPServer((args.host, args.port), PaletteHandler)
+    server.daemon_threads = True
+    logging.info(f"Serving palettes on http://{args.host}:{args.port}{args.path}")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+
+
+if __name__ == "__main__":
+    main()
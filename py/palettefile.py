@@ -0,0 +1,112 @@
+import os
+import struct
+import tempfile
+import zlib
+from typing import List, NamedTuple, Sequence
+
+# Binary palette payload, see WeatherLamp/PaletteFormat.h for the layout. Keep the two in sync.
+PALETTE_MAGIC = b"WL"
+PALETTE_FORMAT_VERSION = 1
+PALETTE_HEADER = struct.Struct("<2sBBBBIHH")
+PALETTE_CRC = struct.Struct("<I")
+
+
+class Palette(NamedTuple):
+    base_time: int
+    slot_minutes: int
+    valid_minutes: int
+    colors: List[List[int]]
+
+
+def encode_palette(
+    colors: Sequence[Sequence[int]], base_time: int, slot_minutes: int = 30, valid_minutes: int = None
+) -> bytes:
+    """
+    Encode RGB slot colours into a versioned palette payload. colors is a sequence of
+    [r, g, b] lists or an (n, 3) uint8 NumPy array.
+
+    base_time is the Unix time of the start of the first slot. valid_minutes defaults
+    to the time covered by the slots.
+    """
+    if not 0 < len(colors) <= 255:
+        raise ValueError(f"Palette must have 1-255 slots, got {len(colors)}")
+    if valid_minutes is None:
+        valid_minutes = len(colors) * slot_minutes
+    header = PALETTE_HEADER.pack(
+        PALETTE_MAGIC,
+        PALETTE_FORMAT_VERSION,
+        PALETTE_HEADER.size,
+        len(colors),
+        0,
+        int(base_time),
+        slot_minutes,
+        valid_minutes,
+    )
+    if hasattr(colors, "tobytes"):
+        rgb = colors.tobytes()  # (n, 3) uint8 NumPy array, already in payload order
+    else:
+        rgb = bytes(int(c) for rgb in colors for c in rgb[:3])
+    body = header + rgb
+    return body + PALETTE_CRC.pack(zlib.crc32(body))
+
+
+def decode_palette(data: bytes) -> Palette:
+    """
+    Decode and validate a palette payload, raising ValueError if it is invalid.
+    """
+    if len(data) < PALETTE_HEADER.size + PALETTE_CRC.size:
+        raise ValueError("Palette payload too short")
+    magic, version, header_size, slots, _flags, base_time, slot_minutes, valid_minutes = PALETTE_HEADER.unpack_from(
+        data
+    )
+    if magic != PALETTE_MAGIC:
+        raise ValueError("Bad palette magic")
+    if version != PALETTE_FORMAT_VERSION or header_size < PALETTE_HEADER.size:
+        raise ValueError(f"Unsupported palette version {version}")
+    if len(data) != header_size + 3 * slots + PALETTE_CRC.size:
+        raise ValueError("Bad palette length")
+    (crc,) = PALETTE_CRC.unpack_from(data, len(data) - PALETTE_CRC.size)
+    if zlib.crc32(data[: -PALETTE_CRC.size]) != crc:
+        raise ValueError("Bad palette CRC")
+    rgb = data[header_size : header_size + 3 * slots]
+    colors = [list(rgb[i : i + 3]) for i in range(0, len(rgb), 3)]
+    return Palette(base_time, slot_minutes, valid_minutes, colors)
+
+
+def write_if_changed(path: str, data: bytes) -> bool:
+    """
+    Write data to path atomically, but only if the content differs from the existing file.
+
+    Static web servers derive ETag and Last-Modified from the file's size and mtime,
+    so leaving an unchanged file untouched lets them answer lamps' conditional
+    requests with 304 Not Modified. Returns True if the file was (re)written.
+    """
+    try:
+        with open(path, "rb") as f:
+            if f.read() == data:
+                return False
+    except FileNotFoundError:
+        pass
+    # Write to a temporary file in the same directory and rename it over the old one,
+    # so the web server never serves a half-written palette
+    fd, tmp_path = tempfile.mkstemp(dir=os.path.dirname(os.path.abspath(path)), prefix=".tmp-")
+    try:
+        with os.fdopen(fd, "wb") as f:
+            f.write(data)
+        os.chmod(tmp_path, 0o644)
+        os.replace(tmp_path, path)
+    except BaseException:
+        os.unlink(tmp_path)
+        raise
+    return True
+
+
+def publish_palette(data: bytes, topic: str, hostname: str, port: int = 1883, username: str = None, password: str = None):
+    """
+    Publish a palette payload as a retained MQTT message, so lamps get the current
+    palette as soon as they subscribe to their location's topic.
+    """
+    import paho.mqtt.publish as publish  # Optional dependency, only needed when publishing
+
+    auth = {"username": username, "password": password} if username else None
+    publish.single(topic, payload=data, qos=1, retain=True, hostname=hostname, port=port, auth=auth)
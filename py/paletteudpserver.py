@@ -0,0 +1,166 @@
+import argparse
+import asyncio
+import logging
+import os
+import struct
+import time
+from typing import Dict, Optional, Tuple
+
+from palettefile import PALETTE_CRC, PALETTE_HEADER
+
+# UDP palette fetch protocol, see WeatherLamp/PaletteUdpFetch.h for the layout. Keep the two in sync.
+UDP_FETCH_VERSION = 1
+UDP_FETCH_HEADER = struct.Struct("<2sBBII")
+REQUEST_MAGIC = b"WQ"
+RESPONSE_MAGIC = b"WP"
+CODE_CONTENT = 0
+CODE_NOT_MODIFIED = 1
+CODE_NOT_FOUND = 2
+CODE_BAD_REQUEST = 3
+CODE_UNAVAILABLE = 4
+MAX_PAYLOAD = PALETTE_HEADER.size + 3 * 96 + PALETTE_CRC.size  # PALETTE_PAYLOAD_MAX, lamps drop anything longer
+# Requests are padded to the largest response, so spoofed ones can't be amplified
+MIN_REQUEST = UDP_FETCH_HEADER.size + MAX_PAYLOAD
+
+
+class PaletteFiles:
+    """
+    Palette files in one directory, read again only when their mtime or size changes.
+    """
+
+    def __init__(self, root: str):
+        self.root = root
+        self.cache: Dict[str, Tuple[float, int, bytes]] = {}
+
+    def get(self, name: str) -> Optional[bytes]:
+        path = os.path.join(self.root, name)
+        try:
+            st = os.stat(path)
+        except OSError:
+            self.cache.pop(name, None)
+            return None
+        cached = self.cache.get(name)
+        if cached and cached[0] == st.st_mtime and cached[1] == st.st_size:
+            return cached[2]
+        with open(path, "rb") as f:
+            data = f.read()
+        logging.info(f"Loaded {path}, {len(data)} bytes")
+        self.cache[name] = (st.st_mtime, st.st_size, data)
+        return data
+
+
+def file_name(path: bytes) -> Optional[str]:
+    """
+    Map a request path like /weatherlamp.bin?lat=60.1&lon=24.9 to a file name in the
+    root directory. Query strings are ignored (the HTTP server does the same) and
+    directories are not served, so a path can't reach outside the root.
+    """
+    try:
+        path_str = path.decode("ascii")
+    except UnicodeDecodeError:
+        return None
+    name = path_str.split("?", 1)[0].rsplit("/", 1)[-1]
+    if not name or name.startswith("."):
+        return None
+    return name
+
+
+class PaletteUdpServer(asyncio.DatagramProtocol):
+    def __init__(self, files: PaletteFiles, max_age: int):
+        self.files = files
+        self.max_age = max_age
+        self.transport: Optional[asyncio.DatagramTransport] = None
+
+    def connection_made(self, transport: asyncio.BaseTransport):
+        self.transport = transport
+
+    def datagram_received(self, data: bytes, addr: Tuple[str, int]):
+        if len(data) < UDP_FETCH_HEADER.size:
+            return
+        magic, version, _flags, token, have_crc = UDP_FETCH_HEADER.unpack_from(data)
+        if magic != REQUEST_MAGIC:
+            return
+        if version != UDP_FETCH_VERSION:
+            self.reply(addr, CODE_BAD_REQUEST, token)
+            return
+        if len(data) < MIN_REQUEST:
+            # The answer is a bare header, no bigger than the request
+            self.reply(addr, CODE_BAD_REQUEST, token)
+            return
+        name = file_name(data[UDP_FETCH_HEADER.size :].rstrip(b"\0"))
+        if name is None:
+            self.reply(addr, CODE_BAD_REQUEST, token)
+            return
+        try:
+            payload = self.files.get(name)
+        except OSError as err:
+            logging.warning(f"Can't read {name}: {err}")
+            self.reply(addr, CODE_UNAVAILABLE, token, max_age=60)
+            return
+        if payload is None or not PALETTE_CRC.size <= len(payload) <= MAX_PAYLOAD:
+            logging.info(f"{addr[0]} {name} not found")
+            self.reply(addr, CODE_NOT_FOUND, token)
+            return
+        (crc,) = PALETTE_CRC.unpack_from(payload, len(payload) - PALETTE_CRC.size)
+        if have_crc and have_crc == crc:
+            logging.debug(f"{addr[0]} {name} not modified")
+            self.reply(addr, CODE_NOT_MODIFIED, token)
+        else:
+            logging.info(f"{addr[0]} {name} {len(payload)} bytes")
+            self.reply(addr, CODE_CONTENT, token, payload)
+
+    def reply(self, addr: Tuple[str, int], code: int, token: int, payload: bytes = b"", max_age: int = None):
+        if max_age is None:
+            max_age = self.max_age
+        header = UDP_FETCH_HEADER.pack(RESPONSE_MAGIC, UDP_FETCH_VERSION, code, token, max_age)
+        self.transport.sendto(header + payload, addr)
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(add_help=True)
+    parser.add_argument(
+        "--log",
+        dest="log",
+        choices=["DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"],
+        default="ERROR",
+        help="Set the logging level",
+    )
+    parser.add_argument("--root", required=True, help="Directory of palette files written by the generators")
+    parser.add_argument("--host", default="0.0.0.0", help="Address to listen on")
+    parser.add_argument("--port", type=int, default=5688, help="UDP port (UDP_FETCH_DEFAULT_PORT on the lamps)")
+    parser.add_argument(
+        "--max-age",
+        type=int,
+        default=300,
+        help="Seconds until lamps poll again, like HTTP Cache-Control max-age. Match the generators' schedule.",
+    )
+    args = parser.parse_args()
+    if args.log:
+        logging.basicConfig(
+            level=getattr(logging, args.log),
+            datefmt="%Y-%m-%dT%H:%M:%S",
+            format="%(asctime)s.%(msecs)03dZ %(levelname)s %(message)s",
+        )
+        logging.Formatter.converter = time.gmtime  # Timestamps in UTC time
+    return args
+
+
+def main():
+    args = parse_args()
+    loop = asyncio.new_event_loop()
+    files = PaletteFiles(args.root)
+    transport, _ = loop.run_until_complete(
+        loop.create_datagram_endpoint(lambda: PaletteUdpServer(files, args.max_age), local_addr=(args.host, args.port))
+    )
+    logging.info(f"Serving {args.root} on udp://{args.host}:{args.port}")
+    try:
+        loop.run_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        transport.close()
+        loop.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -1,17 +1,29 @@
 import argparse
+import collections
 import datetime
 import json
 import logging
-import os
+import sys
 import time
+from concurrent.futures import Future, ThreadPoolExecutor
+from email.utils import parsedate_to_datetime
+from typing import Dict, List, Optional, Tuple
 
+import numpy as np
 import pandas as pd
 import pytz
 import requests
 from dateutil.parser import parse
 
+from forecastarchive import data_id, get_archive
+from palettefile import encode_palette, publish_palette, write_if_changed
+
 API_URL: str = "https://api.met.no/weatherapi/{}/2.0/complete"
 USER_AGENT: str = "WeatherLamp/0.2 github.com/aapris/WeatherLamp"
+DEFAULT_EXPIRES: int = 300  # Seconds to keep a response that has no Expires header
+REQUEST_TIMEOUT: int = 30
+CAST_TYPES: Tuple[str, str] = ("nowcast", "locationforecast")
+REPLAY_KEEP_RESPONSES: int = 4  # Responses per cast type and location kept in memory while replaying
 
 # TODO: these should be in some configuration file
 COLOUR_CLEARSKY_NIGHT = [5, 18, 151]
@@ -108,6 +120,10 @@ symbolmap = {
     ),
 }
 
+# symbolmap as lookup arrays, so whole forecasts are classified at once
+SYMBOL_INDEX = {symbol: i for i, symbol in enumerate(symbolmap)}
+SYMBOL_COLOURS = np.array(list(symbolmap.values()), dtype=np.uint8)
+
 
 def parse_args() -> argparse.Namespace:
     parser = argparse.ArgumentParser(add_help=True)
@@ -118,11 +134,55 @@ def parse_args() -> argparse.Namespace:
         default="ERROR",
         help="Set the logging level",
     )
-    parser.add_argument("--lat", required=True, help="Latitude in decimal format (dd.ddd)")
-    parser.add_argument("--lon", required=True, help="Longitude in decimal format (dd.ddd)")
-    parser.add_argument("--output", help="Output file name")
-    parser.add_argument("--historypath", help="Where responses are stored")
+    parser.add_argument("--lat", help="Latitude in decimal format (dd.ddd)")
+    parser.add_argument("--lon", help="Longitude in decimal format (dd.ddd)")
+    parser.add_argument("--output", help="Output file name, {lat} and {lon} are replaced with the location")
+    parser.add_argument(
+        "--batch",
+        help="File with one lat,lon pair per line, palettes for all of them are generated in parallel. "
+        "Use {lat} and {lon} in --output and --mqtt-topic.",
+    )
+    parser.add_argument(
+        "--concurrency", type=int, default=4, help="Upstream requests in flight at the same time in --batch mode"
+    )
+    parser.add_argument(
+        "--historypath", help="Archive upstream responses and generated palettes in this directory, see --replay"
+    )
+    parser.add_argument(
+        "--replay",
+        action="store_true",
+        help="Regenerate the palettes archived in --historypath offline and compare them with the archived ones",
+    )
+    parser.add_argument("--replay-from", help="Replay records from this UTC date or time on (ISO 8601)")
+    parser.add_argument("--replay-to", help="Replay records before this UTC date or time (ISO 8601)")
+    parser.add_argument(
+        "--no-cache", action="store_true", help="Always download, don't read or write yr-cache-*.json files"
+    )
+    parser.add_argument(
+        "--hours",
+        type=int,
+        default=8,
+        help="Hours of 30 minute slots to include (8-48). Lamps show 8 hours at a time and slide "
+        "along longer bundles by themselves, so they need to fetch less often.",
+    )
+    parser.add_argument("--mqtt-host", help="Publish palette as a retained message to this MQTT broker")
+    parser.add_argument("--mqtt-port", type=int, default=1883, help="MQTT broker port")
+    parser.add_argument("--mqtt-user", help="MQTT username")
+    parser.add_argument("--mqtt-password", help="MQTT password")
+    parser.add_argument(
+        "--mqtt-topic",
+        default="weatherlamp/palette/{lat}_{lon}",
+        help="MQTT topic, {lat} and {lon} are replaced with the location (must match the lamps' MQTT_PALETTE_TOPIC)",
+    )
     args = parser.parse_args()
+    if args.replay and args.historypath is None:
+        parser.error("--replay needs --historypath")
+    if args.batch is None and not args.replay and (args.lat is None or args.lon is None):
+        parser.error("--lat and --lon are required without --batch or --replay")
+    if not 8 <= args.hours <= 48:
+        parser.error("--hours must be between 8 and 48")
+    if args.concurrency < 1:
+        parser.error("--concurrency must be at least 1")
     if args.log:
         logging.basicConfig(
             level=getattr(logging, args.log),
@@ -133,31 +193,103 @@ def parse_args() -> argparse.Namespace:
     return args
 
 
-def get_yrdata(args, cast_type="locationforecast"):
-    cachefile = f"yr-cache-{cast_type}.{args.lat}_{args.lon}.json"
-    if os.path.isfile(cachefile):
-        logging.info(f"Using cached data from {cachefile}")
+def read_cache(cachefile: str) -> Optional[dict]:
+    """
+    Return the cache entry in cachefile, None if there is no usable one.
+    """
+    try:
         with open(cachefile, "rt") as f:
-            yrdata = json.loads(f.read())
+            entry = json.load(f)
+    except (OSError, ValueError):
+        return None
+    if not isinstance(entry, dict) or "data" not in entry:
+        return None  # Written by an older version without the headers, download again
+    return entry
+
+
+def response_expires(res: requests.Response) -> float:
+    """
+    Unix time until which met.no asks us not to request the data again.
+    """
+    try:
+        return parsedate_to_datetime(res.headers["Expires"]).timestamp()
+    except (KeyError, TypeError, ValueError):
+        return time.time() + DEFAULT_EXPIRES
+
+
+def make_session(pool_size: int = 2) -> requests.Session:
+    """
+    HTTP session whose connections to met.no are kept open and shared between threads,
+    so each request after the first skips the TCP and TLS handshakes.
+    """
+    session = requests.Session()
+    session.headers["User-Agent"] = USER_AGENT
+    adapter = requests.adapters.HTTPAdapter(pool_connections=1, pool_maxsize=pool_size)
+    session.mount("https://", adapter)
+    return session
+
+
+def get_yrdata(args, cast_type="locationforecast", session: requests.Session = None, memory: Dict[str, dict] = None):
+    """
+    Return met.no data for args.lat, args.lon, from the cache file until it expires.
+
+    The cache entry keeps the response's Expires and Last-Modified headers. After it
+    expires the data is revalidated with If-Modified-Since, an unchanged forecast
+    costs a 304 without a body. If met.no can't be reached, stale data is better
+    than none.
+
+    memory keeps the entries by cast type instead of the cache files, for long
+    running callers that fetch the same location again and again.
+    """
+    if memory is not None:
+        cachefile = "memory"
+        entry = memory.get(cast_type)
     else:
-        parameters = f"lat={args.lat}&lon={args.lon}"
-        headers = {"User-Agent": USER_AGENT}
-        url = API_URL.format(cast_type)
-        full_url = f"{url}?{parameters}"
-        logging.info(f"Requesting data from {full_url}")
-        res = requests.get(full_url, headers=headers)
-        if res.status_code == 200:
-            logging.info(f"Got 200 OK")
-        elif res.status_code == 203:
+        cachefile = f"yr-cache-{cast_type}.{args.lat}_{args.lon}.json"
+        entry = None if args.no_cache else read_cache(cachefile)
+    if entry is not None and time.time() < entry["expires"]:
+        logging.info(f"Using cached data from {cachefile}")
+        return entry["data"]
+
+    parameters = f"lat={args.lat}&lon={args.lon}"
+    headers = {} if session else {"User-Agent": USER_AGENT}
+    if entry is not None and entry.get("last_modified"):
+        headers["If-Modified-Since"] = entry["last_modified"]
+    url = API_URL.format(cast_type)
+    full_url = f"{url}?{parameters}"
+    logging.info(f"Requesting data from {full_url}")
+    try:
+        res = (session or requests).get(full_url, headers=headers, timeout=REQUEST_TIMEOUT)
+    except requests.RequestException as err:
+        if entry is None:
+            raise
+        logging.warning(f"Request failed ({err}), using stale data from {cachefile}")
+        return entry["data"]
+    logging.debug(res.headers)
+    if res.status_code == 304 and entry is not None:
+        logging.info(f"Got 304 Not Modified")
+    elif res.status_code in (200, 203):
+        if res.status_code == 203:
             logging.warning(f"Got 203, read the docs")
         else:
-            logging.warning(f"Got {res.status_code}!")
+            logging.info(f"Got 200 OK")
+        entry = {"last_modified": res.headers.get("Last-Modified"), "data": res.json()}
+        if args.historypath is not None:
+            get_archive(args.historypath).add_response(cast_type, args.lat, args.lon, entry["data"], time.time())
+    elif entry is not None:
+        logging.warning(f"Got {res.status_code}, using stale data from {cachefile}")
+        return entry["data"]
+    else:
+        logging.warning(f"Got {res.status_code}!")
+        res.raise_for_status()
+        raise requests.HTTPError(f"Unexpected status {res.status_code}", response=res)
+    entry["expires"] = response_expires(res)
+    if memory is not None:
+        memory[cast_type] = entry
+    elif not args.no_cache:
         logging.info(f"Caching data to {cachefile}")
-        yrdata = res.json()
-        with open(cachefile, "wt") as f:
-            f.write(json.dumps(yrdata, indent=2))
-        logging.debug(res.headers)
-    return yrdata
+        write_if_changed(cachefile, json.dumps(entry, separators=(",", ":")).encode())
+    return entry["data"]
 
 
 def add_to_dict(dict_: dict, key: str, val: float):
@@ -166,7 +298,7 @@ def add_to_dict(dict_: dict, key: str, val: float):
     dict_[key].append(val)
 
 
-def yr_precipitation_to_df(args, yrdata, cast):
+def yr_precipitation_to_df(args, yrdata, cast, now: datetime.datetime = None):
     timeseries = yrdata["properties"]["timeseries"]
     tss = []
     pers = {}
@@ -200,56 +332,211 @@ def yr_precipitation_to_df(args, yrdata, cast):
     # print(df)
     df.index.name = "time"
     dfr = df.resample("30min").max().fillna(method="pad")
-    now = datetime.datetime.now(tz=pytz.UTC)
+    if now is None:
+        now = datetime.datetime.now(tz=pytz.UTC)
     this_halfhour = now.replace(minute=0, second=0, microsecond=0)
     if (now - this_halfhour).total_seconds() > 30 * 60:
         this_halfhour += datetime.timedelta(minutes=30)
-    last_halfhour = this_halfhour + datetime.timedelta(hours=8)
+    last_halfhour = this_halfhour + datetime.timedelta(hours=args.hours)
     # print(this_halfhour, last_halfhour)
     df_filtered: pd.DataFrame = dfr[(dfr.index >= this_halfhour) & (dfr.index < last_halfhour)]
     # print(df_filtered)
     return df_filtered
 
 
-def create_combined_forecast(args: argparse.Namespace) -> pd.DataFrame:
-    nowcast = get_yrdata(args, "nowcast")
-    df_now = yr_precipitation_to_df(args, nowcast, "now")
+def fetch_yrdata(
+    args: argparse.Namespace, session: requests.Session, executor: ThreadPoolExecutor, memory: Dict[str, dict] = None
+) -> List[Future]:
+    """
+    Start fetching the nowcast and the forecast for args.lat, args.lon in parallel.
+    """
+    return [executor.submit(get_yrdata, args, cast_type, session, memory) for cast_type in CAST_TYPES]
 
-    forecast = get_yrdata(args)
-    df_fore = yr_precipitation_to_df(args, forecast, "fore")
+
+def create_combined_forecast(
+    args: argparse.Namespace, nowcast: dict, forecast: dict, now: datetime.datetime = None
+) -> pd.DataFrame:
+    df_now = yr_precipitation_to_df(args, nowcast, "now", now)
+    df_fore = yr_precipitation_to_df(args, forecast, "fore", now)
 
     merge = pd.concat([df_now, df_fore], axis=1)
-    print(merge)
-    assert len(merge.index) == 16
+    logging.debug(f"Combined forecast:\n{merge}")
+    assert len(merge.index) == args.hours * 2
     return merge
 
 
-def create_output(args: argparse.Namespace):
-    df = create_combined_forecast(args)
-    colors = []
-    for i in df.index:
-        # Take always nowcast's precipitation, it should be the most accurate
-        if pd.notnull(df["precipitation_now"][i]):
-            precipitation = df["precipitation_now"][i]
+def classify_colors(df: pd.DataFrame) -> np.ndarray:
+    """
+    Map each slot of a combined forecast to its colour, returns an (n, 3) uint8 array.
+
+    Heavy enough precipitation decides the colour, otherwise the weather symbol does.
+    Nowcast's precipitation is preferred, it should be the most accurate.
+    """
+    precipitation = df["precipitation_now"].fillna(df["precipitation_fore"]).to_numpy()
+    symbol_index = df["symbol"].map(SYMBOL_INDEX)
+    by_symbol = ~(precipitation >= 0.5)
+    unknown = by_symbol & symbol_index.isna().to_numpy()
+    if unknown.any():
+        raise KeyError(f"No colour for symbols {sorted(set(df['symbol'][unknown]))}")
+    colors = SYMBOL_COLOURS[symbol_index.fillna(0).to_numpy(dtype=np.intp)]
+    colors[precipitation >= 0.5] = COLOUR_LIGHTRAIN
+    colors[precipitation >= 3.0] = COLOUR_VERYHEAVYRAIN
+    return colors
+
+
+def build_palette(
+    args: argparse.Namespace,
+    session: requests.Session = None,
+    yrdata: Tuple[dict, dict] = None,
+    now: datetime.datetime = None,
+    memory: Dict[str, dict] = None,
+) -> bytes:
+    """
+    Encode the forecasts for args.lat, args.lon as a palette payload. yrdata is the
+    nowcast and forecast if they have been fetched already, otherwise both are
+    fetched at once over session (a new one if None), cached in memory if given
+    (see get_yrdata()). now is only given when replaying, the palette starts from
+    its half hour.
+    """
+    if yrdata is None:
+        with ThreadPoolExecutor(len(CAST_TYPES)) as executor:
+            yrdata = [f.result() for f in fetch_yrdata(args, session or make_session(), executor, memory)]
+    if now is None:
+        now = datetime.datetime.now(tz=pytz.UTC)
+    df = create_combined_forecast(args, *yrdata, now)
+    colors = classify_colors(df)
+    assert len(colors) == args.hours * 2
+    data = encode_palette(colors, int(df.index[0].timestamp()))
+    if args.historypath is not None:
+        inputs = {cast_type: data_id(d) for cast_type, d in zip(CAST_TYPES, yrdata)}
+        get_archive(args.historypath).add_palette(args.lat, args.lon, args.hours, inputs, data, now.timestamp())
+    return data
+
+
+def create_output(args: argparse.Namespace, yrdata: Tuple[dict, dict] = None):
+    data = build_palette(args, yrdata=yrdata)
+    changed = True
+    if args.output is not None:
+        output = args.output.format(lat=args.lat, lon=args.lon)
+        changed = write_if_changed(output, data)
+        if changed:
+            logging.info(f"Wrote new palette to {output}")
         else:
-            precipitation = df["precipitation_fore"][i]
-        if precipitation >= 3.0:
-            color = COLOUR_VERYHEAVYRAIN
-        elif precipitation >= 0.5:
-            color = COLOUR_LIGHTRAIN
+            logging.info(f"Palette unchanged, kept {output} as is")
+    # Retained message is still there if nothing changed, no need to wake up the lamps
+    if args.mqtt_host is not None and changed:
+        topic = args.mqtt_topic.format(lat=args.lat, lon=args.lon)
+        logging.info(f"Publishing palette to {topic}")
+        publish_palette(data, topic, args.mqtt_host, args.mqtt_port, args.mqtt_user, args.mqtt_password)
+
+
+def read_locations(path: str) -> List[Tuple[str, str]]:
+    locations = []
+    with open(path, "rt") as f:
+        for line in f:
+            line = line.split("#", 1)[0].strip()
+            if line:
+                lat, lon = (part.strip() for part in line.split(","))
+                locations.append((lat, lon))
+    return locations
+
+
+def create_batch_output(args: argparse.Namespace) -> int:
+    """
+    Generate palettes for all locations in args.batch, returns the number that failed.
+
+    All upstream requests go through one pool of args.concurrency threads and one
+    session, so the wall time is close to the slowest requests, not their sum.
+    Palettes are built on the main thread as their data arrives.
+    """
+    locations = read_locations(args.batch)
+    started = time.monotonic()
+    failed = 0
+    with ThreadPoolExecutor(args.concurrency) as executor:
+        session = make_session(args.concurrency)
+        jobs = []
+        for lat, lon in locations:
+            location_args = argparse.Namespace(**{**vars(args), "lat": lat, "lon": lon})
+            jobs.append((location_args, fetch_yrdata(location_args, session, executor)))
+        for location_args, futures in jobs:
+            try:
+                create_output(location_args, [f.result() for f in futures])
+            except Exception:
+                logging.exception(f"Palette for {location_args.lat},{location_args.lon} failed")
+                failed += 1
+    logging.info(f"{len(locations)} locations in {time.monotonic() - started:.1f} s, {failed} failed")
+    return failed
+
+
+def parse_utc(value: Optional[str]) -> Optional[float]:
+    if value is None:
+        return None
+    return parse(value).replace(tzinfo=pytz.UTC).timestamp()
+
+
+def replay(args: argparse.Namespace) -> int:
+    """
+    Rebuild every palette archived in args.historypath from the archived responses,
+    without network access, and compare it with the archived palette. With --lat and
+    --lon only that location is replayed. Returns the number of palettes that differ.
+    """
+    archive = get_archive(args.historypath)
+    responses: Dict[str, dict] = {}
+    latest: Dict[Tuple[str, str, str], collections.deque] = {}
+    counts = collections.Counter()
+    build_seconds = 0.0
+    start = parse_utc(args.replay_from)
+    # Palettes early in the range can be built from responses archived before it, so responses
+    # are read from the start of the archive and only palettes are filtered by --replay-from
+    for record in archive.records(None, parse_utc(args.replay_to)):
+        if args.lat is not None and (record["lat"], record["lon"]) != (args.lat, args.lon):
+            continue
+        if record["type"] == "response":
+            # Palettes use the newest responses, or older ones from the yr-cache files
+            ids = latest.setdefault((record["cast_type"], record["lat"], record["lon"]), collections.deque())
+            ids.append(record["id"])
+            responses[record["id"]] = record["data"]
+            if len(ids) > REPLAY_KEEP_RESPONSES:
+                responses.pop(ids.popleft(), None)
+            continue
+        if start is not None and record["time"] < start:
+            continue
+        try:
+            yrdata = [responses[record["inputs"][cast_type]] for cast_type in CAST_TYPES]
+        except KeyError:
+            counts["missing input"] += 1
+            continue
+        location_args = argparse.Namespace(
+            lat=record["lat"], lon=record["lon"], hours=record["hours"], historypath=None
+        )
+        when = datetime.datetime.fromtimestamp(record["time"], tz=pytz.UTC)
+        started = time.perf_counter()
+        try:
+            data = build_palette(location_args, yrdata=yrdata, now=when)
+        except Exception:
+            logging.exception(f"Palette for {record['lat']},{record['lon']} at {when.isoformat()} failed")
+            counts["failed"] += 1
+            continue
+        finally:
+            build_seconds += time.perf_counter() - started
+        if data.hex() == record["palette"]:
+            counts["same"] += 1
         else:
-            color = symbolmap[df["symbol"][i]]
-        # print(df['precipitation_now'][i], df['precipitation_fore'][i], precipitation)
-        colors += color + [0]
-    assert len(colors) == 64
-    if args.output is not None:
-        arr = bytearray(colors)
-        with open(args.output, "wb") as f:
-            f.write(arr)
+            logging.warning(f"Palette for {record['lat']},{record['lon']} at {when.isoformat()} differs")
+            counts["different"] += 1
+    built = counts["same"] + counts["different"] + counts["failed"]
+    per_palette = f", {1000 * build_seconds / built:.1f} ms per palette" if built else ""
+    summary = ", ".join(f"{k} {v}" for k, v in sorted(counts.items())) or "nothing archived in range"
+    print(f"Replayed {built} palettes in {build_seconds:.2f} s{per_palette}: {summary}")
+    return counts["different"] + counts["failed"]
 
 
 def main():
     args = parse_args()
+    if args.replay:
+        sys.exit(1 if replay(args) else 0)
+    if args.batch is not None:
+        sys.exit(1 if create_batch_output(args) else 0)
     create_output(args)
 
 